@@ -1,7 +1,7 @@
 // Provided using BSD license
 // Author: Patricio Loncomilla, year 2023
 
-// NOTE: In g++, compile with -O3
+// NOTE: In g++, compile with -O3 (add -pthread when using ExprVectorExecutor or ev::async_*)
 // NOTE: In msvc, compile with /std:c++14 /O2 /EHsc. Not using /EHsc will cause the code to crash
 
 #ifndef EXPR_VECTOR_H_PL_
@@ -17,6 +17,75 @@
 #include <limits>
 #include <sstream>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <new>
+#include <cstdint>
+#include <iterator>
+#include <array>
+#include <utility>
+#include <tuple>
+#include <map>
+#include <cstdlib>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+// a*b + c is evaluated with std::fma when the target has FMA instructions. Define EXPR_VECTOR_FMA as 1 to
+// always contract (more accurate, but slow without hardware FMA) or as 0 to never contract
+#ifndef EXPR_VECTOR_FMA
+#if defined(__FMA__) || defined(__AVX2__) || defined(__ARM_FEATURE_FMA)
+#define EXPR_VECTOR_FMA 1
+#else
+#define EXPR_VECTOR_FMA 0
+#endif
+#endif
+
+// Large assignments use non-temporal (streaming) stores on x86, see ev::stream_threshold(). Define
+// EXPR_VECTOR_STREAM as 0 to always use regular stores
+#ifndef EXPR_VECTOR_STREAM
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EXPR_VECTOR_STREAM 1
+#else
+#define EXPR_VECTOR_STREAM 0
+#endif
+#endif
+
+#if EXPR_VECTOR_STREAM
+#include <immintrin.h>
+#endif
+
+// Evaluation loops are compiled for SSE4.2, AVX2 and AVX-512 too, and the best one the CPU supports is chosen
+// at run time (see ev::isa()). Define EXPR_VECTOR_DISPATCH as 0 to compile them only for the build target
+#ifndef EXPR_VECTOR_DISPATCH
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(__AVX512F__)
+#define EXPR_VECTOR_DISPATCH 1
+#else
+#define EXPR_VECTOR_DISPATCH 0
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Start of main classes for ExprVector
 
@@ -57,6 +126,7 @@ public:
   }
   
   inline T* data() {return buffer_;}
+  inline const T* data() const {return buffer_;}
   
   inline std::size_t size() const
   {
@@ -64,6 +134,203 @@ public:
   }
 };
 
+#if defined(__unix__) || defined(__APPLE__)
+/** BuffDataShm keeps its elements in a named POSIX shared memory segment, so several processes evaluate expressions
+    over the same physical memory. The segment starts with a header (type, size, layout version) checked on attach,
+    and a generation counter for a single writer and many readers: begin_write() / end_write() publish the data,
+    readers wait_ready() and can check unchanged() after reading. Linking with -lrt may be needed on old glibc **/
+template<typename T>
+class BuffDataShm
+{
+  static_assert(std::is_trivially_copyable<T>::value, "BuffDataShm requires a trivially copyable type");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "BuffDataShm requires lock free (address free) atomics");
+
+public:
+  static constexpr std::uint32_t version = 1;
+
+  struct alignas(64) Header
+  {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t elem_size;
+    char kind;                                // 'f', 'i', 'u' or 'V' (other types), as in numpy
+    std::uint64_t n;
+    std::atomic<std::uint64_t> generation;    // odd while being written, even (> 0) when ready
+  };
+
+private:
+  T* buffer_ = nullptr;
+  size_t n_ = 0;
+  Header* header_ = nullptr;
+  size_t map_size_ = 0;
+  std::string name_;
+  bool owner_ = false;
+  bool writable_ = false;
+
+  [[noreturn]] void read_only_error() const {throw ExprVectorException(("BuffDataShm: " + name_ + " is attached read only").c_str());}
+
+  inline void check_writable() const
+  {
+    if (!writable_)
+      read_only_error();
+  }
+
+  static char kind() {return std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : std::is_unsigned<T>::value ? 'u' : 'V';}
+
+  static std::string shm_name(const std::string& name) {return name.empty() || name[0] != '/' ? "/" + name : name;}
+
+  static size_t bytes(size_t n) {return sizeof(Header) + n*sizeof(T);}
+
+  void map(int fd, size_t size, bool writable)
+  {
+    void* p = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      throw ExprVectorException(("BuffDataShm: cannot map " + name_).c_str());
+    header_ = static_cast<Header*>(p);
+    map_size_ = size;
+    buffer_ = reinterpret_cast<T*>(static_cast<char*>(p) + sizeof(Header));
+  }
+
+public:
+  BuffDataShm() {}
+  BuffDataShm(const BuffDataShm& other) = delete;
+  ~BuffDataShm() {close();}
+
+  // Creates a segment for n elements, replacing an existing one with the same name (processes
+  // attached to the old one keep it). The segment is removed when its creator closes it
+  void create(const std::string& name, size_t n)
+  {
+    close();
+    name_ = shm_name(name);
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, bytes(n)) != 0)
+    {
+      if (fd >= 0)
+      {
+        ::close(fd);
+        shm_unlink(name_.c_str());
+      }
+      throw ExprVectorException(("BuffDataShm: cannot create " + name_).c_str());
+    }
+    map(fd, bytes(n), true);
+    owner_ = true;
+    writable_ = true;
+    n_ = n;
+    std::memcpy(header_->magic, "EXPRVSHM", 8);
+    header_->version = version;
+    header_->elem_size = sizeof(T);
+    header_->kind = kind();
+    header_->n = n;
+    new(&header_->generation) std::atomic<std::uint64_t>(0);
+  }
+
+  // Attaches to an existing segment, read only unless writable is true
+  void attach(const std::string& name, bool writable = false)
+  {
+    close();
+    name_ = shm_name(name);
+    int fd = shm_open(name_.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header))
+    {
+      if (fd >= 0)
+        ::close(fd);
+      throw ExprVectorException(("BuffDataShm: cannot open " + name_).c_str());
+    }
+    map(fd, st.st_size, writable);
+    if (std::memcmp(header_->magic, "EXPRVSHM", 8) != 0 || header_->version != version || header_->elem_size != sizeof(T) ||
+        header_->kind != kind() || bytes(header_->n) > map_size_)
+    {
+      close();
+      throw ExprVectorException("BuffDataShm: the segment has a different type, size or version");
+    }
+    n_ = header_->n;
+    writable_ = writable;
+  }
+
+  void close()
+  {
+    if (header_ != nullptr)
+      munmap(header_, map_size_);
+    if (owner_)
+      shm_unlink(name_.c_str());
+    header_ = nullptr;
+    buffer_ = nullptr;
+    n_ = 0;
+    owner_ = false;
+    writable_ = false;
+  }
+
+  // False for a segment attached read only, whose elements can't be written (mutable access throws)
+  bool writable() const {return writable_;}
+
+  const std::string& name() const {return name_;}
+
+  // Writer side: the data is being modified between begin_write() and end_write()
+  void begin_write() {header_->generation.fetch_add(1, std::memory_order_acq_rel);}
+  void end_write() {header_->generation.fetch_add(1, std::memory_order_release);}
+
+  std::uint64_t generation() const {return header_->generation.load(std::memory_order_acquire);}
+
+  bool ready() const
+  {
+    std::uint64_t g = generation();
+    return g > 0 && g % 2 == 0;
+  }
+
+  // Reader side: waits until data newer than generation "after" is published, and returns its generation
+  std::uint64_t wait_ready(std::uint64_t after = 0) const
+  {
+    for (int spins = 0;; spins++)
+    {
+      std::uint64_t g = generation();
+      if (g > after && g % 2 == 0)
+        return g;
+      if (spins < 64)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  // True if the writer didn't start modifying the data since generation g was read
+  bool unchanged(std::uint64_t g) const
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return header_->generation.load(std::memory_order_relaxed) == g;
+  }
+
+  inline T operator[](const std::size_t i) const
+  {
+    return buffer_[i];
+  }
+
+  inline T& operator[](const std::size_t i)
+  {
+    check_writable();
+    return buffer_[i];
+  }
+
+  inline T* data()
+  {
+    check_writable();
+    return buffer_;
+  }
+
+  inline const T* data() const {return buffer_;}
+
+  inline std::size_t size() const
+  {
+    return n_;
+  }
+};
+
+template<typename T>
+constexpr std::uint32_t BuffDataShm<T>::version;
+#endif
+
 template<typename T, typename Op1>
 class BuffDataStrided
 {
@@ -96,6 +363,298 @@ public:
 };
 
 
+/** BuffDataFixed is a std::array backed buffer whose length N is known at compile time (no heap allocation) */
+template<typename T, std::size_t N>
+class BuffDataFixed
+{
+  std::array<T, N> buffer_;
+
+public:
+  constexpr BuffDataFixed() : buffer_() {}
+  explicit constexpr BuffDataFixed(std::size_t n) : buffer_() {if (n != N) throw ExprVectorException("BuffDataFixed created with a wrong size");}
+  BuffDataFixed(std::size_t n, const T& value) {if (n != N) throw ExprVectorException("BuffDataFixed created with a wrong size"); buffer_.fill(value);}
+
+  template<typename It, typename = typename std::iterator_traits<It>::iterator_category>
+  BuffDataFixed(It first, It last) : buffer_() {if (last - first != std::ptrdiff_t(N)) throw ExprVectorException("BuffDataFixed created with a wrong size"); for (std::size_t i = 0; i < N; i++) buffer_[i] = first[i];}
+
+  inline constexpr T operator[](const std::size_t i) const
+  {
+    return buffer_[i];
+  }
+
+  inline constexpr T& operator[](const std::size_t i)
+  {
+    return buffer_[i];
+  }
+
+  inline T* data() {return buffer_.data();}
+  inline const T* data() const {return buffer_.data();}
+
+  static inline constexpr std::size_t size()
+  {
+    return N;
+  }
+};
+
+
+/** BuffDataRing keeps the last "capacity" appended elements (the window) in a circular buffer, and element i
+    is the i-th oldest one. In memory the window is at most two contiguous segments, which ev::ring_apply()
+    evaluates as plain vectors. Constructed with a length it is empty, with a length and a value it is full */
+template<typename T>
+class BuffDataRing
+{
+  std::vector<T> buffer_;
+  size_t head_ = 0;     // position of the oldest element
+  size_t n_ = 0;
+  size_t split_ = 0;    // length of the first segment
+
+  void update() {split_ = std::min(n_, buffer_.size() - head_);}
+
+public:
+  BuffDataRing() {}
+  explicit BuffDataRing(size_t capacity) : buffer_(capacity) {}
+  BuffDataRing(size_t capacity, const T& value) : buffer_(capacity, value), n_(capacity) {update();}
+
+  inline size_t capacity() const {return buffer_.size();}
+
+  void clear() {head_ = n_ = split_ = 0;}
+
+  void push(const T& value)
+  {
+    size_t cap = buffer_.size();
+    if (cap == 0)
+      return;
+    size_t tail = head_ + n_ < cap ? head_ + n_ : head_ + n_ - cap;
+    buffer_[tail] = value;
+    if (n_ < cap)
+      n_++;
+    else if (++head_ == cap)
+      head_ = 0;
+    update();
+  }
+
+  // Appends x[0], ..., x[m-1] (any indexable with size(), as an expression), writing in at most two contiguous runs
+  template<typename Op>
+  void append(const Op& x)
+  {
+    size_t cap = buffer_.size(), m = x.size();
+    if (cap == 0)
+      return;
+    size_t skip = m > cap ? m - cap : 0;    // only the last cap elements are kept
+    size_t tail = (head_ + n_) % cap;
+    for (size_t i = skip; i < m;)
+    {
+      size_t len = std::min(m - i, cap - tail);
+      T* d = buffer_.data() + tail;
+      for (size_t j = 0; j < len; j++)
+        d[j] = x[i + j];
+      i += len;
+      tail = tail + len == cap ? 0 : tail + len;
+    }
+    size_t added = m - skip;
+    if (n_ + added > cap)
+    {
+      head_ = (head_ + n_ + added - cap) % cap;
+      n_ = cap;
+    }
+    else
+      n_ += added;
+    update();
+  }
+
+  // The window is segment 0 followed by segment 1, which is empty unless the window wraps around
+  inline const T* segment_data(int k) const {return k == 0 ? buffer_.data() + head_ : buffer_.data();}
+  inline T* segment_data(int k) {return k == 0 ? buffer_.data() + head_ : buffer_.data();}
+  inline size_t segment_size(int k) const {return k == 0 ? split_ : n_ - split_;}
+
+  // Unsigned wrap around maps the second segment to the start of the buffer, without a modulo
+  inline T operator[](const std::size_t i) const
+  {
+    return buffer_[i + (i < split_ ? head_ : -split_)];
+  }
+
+  inline T& operator[](const std::size_t i)
+  {
+    return buffer_[i + (i < split_ ? head_ : -split_)];
+  }
+
+  inline std::size_t size() const
+  {
+    return n_;
+  }
+};
+
+
+namespace ev
+{
+  // Sorts and merges overlapping or adjacent [begin, end) ranges
+  inline void merge_ranges(std::vector<std::pair<size_t, size_t>>& r)
+  {
+    std::sort(r.begin(), r.end());
+    size_t k = 0;
+    for (size_t i = 1; i < r.size(); i++)
+    {
+      if (r[i].first <= r[k].second)
+        r[k].second = std::max(r[k].second, r[i].second);
+      else
+        r[++k] = r[i];
+    }
+    if (!r.empty())
+      r.resize(k + 1);
+  }
+}
+
+/** BuffDataTracked is an owning buffer which records the index ranges written since they were last taken. Single
+    element writes go through the non const operator[], which also marks plain reads done on non const vectors.
+    Assignments (to slices too) mark their range once, and write the memory directly (see ev::loop_target).
+    Marking is thread safe. ExprVectorMaintained uses the ranges to recompute only what changed **/
+template<typename T>
+class BuffDataTracked
+{
+  // Guards dirty_ (a copy gets its own)
+  struct Lock
+  {
+    std::mutex m;
+
+    Lock() {}
+    Lock(const Lock&) {}
+    Lock& operator=(const Lock&) {return *this;}
+  };
+
+  std::vector<T> buffer_;
+  std::vector<std::pair<size_t, size_t>> dirty_;    // in order of writing, merged when there are too many
+  mutable Lock lock_;
+
+  static constexpr size_t max_ranges = 1024;
+
+public:
+  BuffDataTracked() {}
+  explicit BuffDataTracked(size_t n) : buffer_(n) {}
+  BuffDataTracked(size_t n, const T& value) : buffer_(n, value) {}
+
+  void resize(size_t n)
+  {
+    buffer_.resize(n);
+    {
+      std::lock_guard<std::mutex> lock(lock_.m);
+      dirty_.clear();
+    }
+    mark(0, n);
+  }
+
+  // Marks [begin, end) as written
+  inline void mark(size_t begin, size_t end)
+  {
+    if (begin >= end)
+      return;
+    std::lock_guard<std::mutex> lock(lock_.m);
+    if (!dirty_.empty() && begin <= dirty_.back().second && end >= dirty_.back().first)
+    {
+      dirty_.back().first = std::min(dirty_.back().first, begin);
+      dirty_.back().second = std::max(dirty_.back().second, end);
+      return;
+    }
+    dirty_.emplace_back(begin, end);
+    if (dirty_.size() > max_ranges)
+    {
+      ev::merge_ranges(dirty_);
+      if (dirty_.size() > max_ranges / 2)
+        dirty_.assign(1, std::make_pair(dirty_.front().first, dirty_.back().second));
+    }
+  }
+
+  // Sorted, disjoint written ranges
+  std::vector<std::pair<size_t, size_t>> dirty() const
+  {
+    std::vector<std::pair<size_t, size_t>> r;
+    {
+      std::lock_guard<std::mutex> lock(lock_.m);
+      r = dirty_;
+    }
+    ev::merge_ranges(r);
+    return r;
+  }
+
+  std::vector<std::pair<size_t, size_t>> take_dirty()
+  {
+    std::vector<std::pair<size_t, size_t>> r;
+    {
+      std::lock_guard<std::mutex> lock(lock_.m);
+      r.swap(dirty_);
+    }
+    ev::merge_ranges(r);
+    return r;
+  }
+
+  inline T operator[](const std::size_t i) const
+  {
+    return buffer_[i];
+  }
+
+  inline T& operator[](const std::size_t i)
+  {
+    mark(i, i + 1);
+    return buffer_[i];
+  }
+
+  // Writes through data() are not tracked, so only the const version is given
+  inline const T* data() const {return buffer_.data();}
+
+  // For writers which mark what they write themselves (see ev::loop_target and ExprVectorMaintained)
+  inline T* untracked_data() {return buffer_.data();}
+
+  inline std::size_t size() const
+  {
+    return buffer_.size();
+  }
+};
+
+template<typename T>
+constexpr size_t BuffDataTracked<T>::max_ranges;
+
+namespace ev
+{
+  // Memory written by the evaluation loops in place of a container which records its writes
+  template<typename T>
+  struct plain_memory
+  {
+    T* p;
+    inline T& operator[](std::size_t i) const {return p[i];}
+  };
+
+  template<typename T>
+  struct strided_memory
+  {
+    T* p;
+    long step;
+    inline T& operator[](std::size_t i) const {return p[long(i) * step];}
+  };
+
+  // What a loop writing the elements [b, e) of c writes to: c itself, or the memory of a BuffDataTracked (or of a
+  // strided view of one) after the range has been marked once, so the loop has no per element bookkeeping
+  template<typename C>
+  inline C& loop_target(C& c, std::size_t, std::size_t) {return c;}
+
+  template<typename T>
+  inline plain_memory<T> loop_target(BuffDataTracked<T>& c, std::size_t b, std::size_t e)
+  {
+    c.mark(b, e);
+    return plain_memory<T>{c.untracked_data()};
+  }
+
+  template<typename T>
+  inline strided_memory<T> loop_target(BuffDataStrided<T, BuffDataTracked<T>>& c, std::size_t b, std::size_t e)
+  {
+    if (b < e)
+    {
+      long first = c.start + long(b) * c.step, last = c.start + long(e - 1) * c.step;
+      c.op1.mark(std::size_t(std::min(first, last)), std::size_t(std::max(first, last)) + 1);
+    }
+    return strided_memory<T>{c.op1.untracked_data() + c.start, c.step};
+  }
+}
+
+
 class ExprVectorDefaultIndex
 {
 public:
@@ -121,6 +680,66 @@ public:
   }
 };
 
+/** ExprVectorIterator iterates over the values of an expression, so containers can be constructed from it in one pass */
+template<typename T, typename Op>
+class ExprVectorIterator
+{
+  const Op* op_;
+  std::ptrdiff_t i_;
+
+public:
+  using iterator_category = std::random_access_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const T*;
+  using reference = T;
+
+  ExprVectorIterator(const Op& op, std::size_t i) : op_(&op), i_(i) {}
+
+  inline T operator*() const {return (*op_)[i_];}
+  inline T operator[](difference_type k) const {return (*op_)[i_ + k];}
+
+  inline ExprVectorIterator& operator++() {++i_; return *this;}
+  inline ExprVectorIterator& operator--() {--i_; return *this;}
+  inline ExprVectorIterator operator++(int) {ExprVectorIterator it = *this; ++i_; return it;}
+  inline ExprVectorIterator operator--(int) {ExprVectorIterator it = *this; --i_; return it;}
+  inline ExprVectorIterator& operator+=(difference_type k) {i_ += k; return *this;}
+  inline ExprVectorIterator& operator-=(difference_type k) {i_ -= k; return *this;}
+  inline ExprVectorIterator operator+(difference_type k) const {return ExprVectorIterator(*op_, i_ + k);}
+  inline ExprVectorIterator operator-(difference_type k) const {return ExprVectorIterator(*op_, i_ - k);}
+  inline difference_type operator-(const ExprVectorIterator& other) const {return i_ - other.i_;}
+
+  inline bool operator==(const ExprVectorIterator& other) const {return i_ == other.i_;}
+  inline bool operator!=(const ExprVectorIterator& other) const {return i_ != other.i_;}
+  inline bool operator<(const ExprVectorIterator& other) const {return i_ < other.i_;}
+  inline bool operator>(const ExprVectorIterator& other) const {return i_ > other.i_;}
+  inline bool operator<=(const ExprVectorIterator& other) const {return i_ <= other.i_;}
+  inline bool operator>=(const ExprVectorIterator& other) const {return i_ >= other.i_;}
+};
+
+/** ExprVectorGenerator represents a vector whose element i is computed as fn(i), without being stored */
+template<typename T, typename F>
+class ExprVectorGenerator
+{
+  F fn;
+  std::size_t n;
+
+public:
+  ExprVectorGenerator(F f, std::size_t n) : fn(f), n(n) {}
+
+  const F& function() const {return fn;}
+
+  inline T operator[](const std::size_t i) const
+  {
+    return fn(i);
+  }
+
+  inline std::size_t size() const
+  {
+    return n;
+  }
+};
+
 namespace expr_vector_default_index
 {
 #if __GNUC__ < 6 || (__GNUC__ == 6 && __GNUC_MINOR__ <= 1)  // Old compiler
@@ -174,725 +793,4316 @@ namespace ev
   template<class C>
   using has_resize = 
       decltype(std::declval<C&>().resize(std::declval<size_t>()));  
-}
 
+  template<class C>
+  using has_data = 
+      decltype(std::declval<const C&>().data());  
 
+  template<class C>
+  using has_assign = 
+      decltype(std::declval<C&>().assign(std::declval<const typename C::value_type*>(), std::declval<const typename C::value_type*>()));  
 
-/** ExprVector is the main class which represents a vector/buffer using expression templates */
-template<typename T, typename Cont = std::vector<T>>  //BuffDataExt<T> >
-class ExprVector
-{
-public:
-  Cont cont;
+  /** default_init_allocator default-initializes elements, so resizing doesn't zero fill trivial types */
+  template<typename T, typename A = std::allocator<T>>
+  class default_init_allocator : public A
+  {
+  public:
+    template<typename U>
+    struct rebind {using other = default_init_allocator<U, typename std::allocator_traits<A>::template rebind_alloc<U>>;};
 
-  using DI = ExprVectorDefaultIndex;
+    using A::A;
 
-  // Empty constructed ExprVector must be given a buffer before being used
-  ExprVector() {}
-  
-  // ExprVector with initial size
-  ExprVector(const std::size_t n) : cont(n) {}
+    template<typename U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value) {::new(static_cast<void*>(p)) U;}
 
-  // ExprVector with initial size and value
-  ExprVector(const std::size_t n, const T initialValue) : cont(n, initialValue) {}
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args) {std::allocator_traits<A>::construct(static_cast<A&>(*this), p, std::forward<Args>(args)...);}
+  };
 
-  // Constructor for underlying container
-  ExprVector(const Cont& other) : cont(other) {}
+  // Compile time length of a container (0 if it is only known at run time)
+  template<class C>
+  struct fixed_size : std::integral_constant<std::size_t, 0> {};
 
-  template <typename T2>    //template <typename T2, typename std::enable_if<std::is_same<Cont, std::vector<T2>>::value, nullptr_t>::type = nullptr>
-  ExprVector(std::initializer_list<T2> other)
-  {
-    try_resize_if_needed(other.size());
-    for (std::size_t i = 0; i < cont.size(); ++i)
-      cont[i] = (other.begin())[i];
-  }
+  template<typename T, std::size_t N>
+  struct fixed_size<BuffDataFixed<T, N>> : std::integral_constant<std::size_t, N> {};
 
-  operator ExprVector<T, std::vector<T>>() const {ExprVector<T, std::vector<T>> x; x = *this; return x;}
+  template<class C>
+  using has_mutable_data =
+      decltype(*std::declval<C&>().data() = *std::declval<C&>().data());
 
+  // Assignments to containers of 1 byte numbers are evaluated by blocks (see ExprVector::assign_elements)
+  template<typename T, class C>
+  struct byte_blocked : std::integral_constant<bool, sizeof(T) == 1 && std::is_arithmetic<T>::value && is_detected<has_mutable_data, C>::value &&
+                                                     !(fixed_size<C>::value > 0 && fixed_size<C>::value <= 64)> {};
 
-  template <typename Cont2=Cont, typename std::enable_if<ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>   //   template <typename T2=T, typename std::enable_if<!std::is_same<Cont, BuffDataExt<T2>>::value, nullptr_t>::type = nullptr>
-  void resize(size_t n) {cont.resize(n);}
+  // Assignments to these containers can use streaming stores (see ExprVector::assign_streaming)
+  template<typename T, class C>
+  struct streamable : std::integral_constant<bool, EXPR_VECTOR_STREAM && std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8) &&
+                                                   is_detected<has_mutable_data, C>::value && fixed_size<C>::value == 0> {};
 
-  template <typename T2=T, typename std::enable_if<std::is_same<Cont, BuffDataExt<T2>>::value && std::is_same<T,T2>::value, nullptr_t>::type = nullptr>
-  void setBuffer(T* buffer, size_t n) {cont.setBuffer(buffer,n);}
 
-  template <typename T2=T, typename std::enable_if<std::is_same<Cont, BuffDataExt<T2>>::value && std::is_same<T,T2>::value, nullptr_t>::type = nullptr>
-  void setBuffer(const T* buffer, size_t n) {cont.setBuffer(buffer,n);}  //!< Please don't modify an ExprVector after using this function
+  // std::vector whose resize() leaves trivial elements uninitialized: ExprVector<double, ev::uvector<double>>
+  template<typename T>
+  using uvector = std::vector<T, default_init_allocator<T>>;
 
-  template <typename Cont2=Cont, typename std::enable_if<ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
-  inline void try_resize_if_needed(size_t n)
+  // True for sum and difference nodes that are replaced by a fused multiply-add (see ExprVectorFma)
+  template<class Node>
+  struct fma_contracts : std::false_type {};
+}
+
+
+/** ExprVectorExecutor is a thread pool for running ExprVector computations asynchronously.
+    Tasks declare the memory ranges they write and read, and tasks whose ranges overlap keep submission order **/
+class ExprVectorExecutor
+{
+public:
+  // Bytes [begin, end) written or read by a task
+  struct Span
   {
-    if (cont.size() == 0 || cont.size() != n)
-      cont.resize(n);
-  }
+    std::uintptr_t begin, end;
 
-  template <typename Cont2=Cont, typename std::enable_if<!ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>                 // template<typename T2=T, typename R2=Cont, typename std::enable_if<!std::is_same<Cont, std::vector<T2>>::value, nullptr_t>::type = nullptr>
-  inline void try_resize_if_needed(size_t n) {}
+    inline bool overlaps(const Span& other) const {return begin < other.end && other.begin < end;}
+  };
 
-  // assignment operator for ExprVector of different type
-  template<typename T2=T, typename R2=Cont>
-  ExprVector& operator=(const ExprVector<T2, R2>& other)
+private:
+  struct Task
   {
-    try_resize_if_needed(other.size());
-    for (std::size_t i = 0; i < cont.size(); ++i)
-      cont[i] = other[i];
-    return *this;
-  }
+    std::function<void()> fn;
+    size_t pending = 0;
+    bool done = false;
+    std::vector<std::shared_ptr<Task>> successors;
+  };
 
-  // assignment operator for ExprVector of same type
-  ExprVector& operator=(const ExprVector& other)
+  struct Access
   {
-    try_resize_if_needed(other.size());
-    for (std::size_t i = 0; i < cont.size(); ++i)
-      cont[i] = other[i];
-    return *this;
-  }
+    std::shared_ptr<Task> task;
+    Span span;
+    bool write;
+  };
 
-  template<typename T2=T, typename R2=Cont, typename std::enable_if<std::is_move_assignable<R2>::value && std::is_same<T2,T>::value && std::is_same<R2,Cont>::value, nullptr_t>::type = nullptr>
-  ExprVector& operator=(ExprVector&& other)
+  std::vector<std::thread> workers_;
+  std::vector<std::deque<std::function<void()>>> local_;   // chunks of parallel_for, one queue per worker
+  std::deque<std::shared_ptr<Task>> ready_;
+  std::vector<Access> accesses_;                           // of the unfinished tasks
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable cv_idle_;
+  size_t in_flight_ = 0;
+  size_t min_parallel_size_ = 32768;
+  bool stop_ = false;
+
+  // Index of the worker running the calling thread, or npos outside of any executor
+  static size_t& current_worker() {static thread_local size_t k = npos; return k;}
+
+  void worker(size_t k)
   {
-    cont = std::move(other.cont);
-    return *this;
+    current_worker() = k;
+    for (;;)
+    {
+      std::function<void()> job;
+      std::shared_ptr<Task> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, k]{ return stop_ || !ready_.empty() || !local_[k].empty(); });
+        if (!local_[k].empty())
+        {
+          job = std::move(local_[k].front());
+          local_[k].pop_front();
+        }
+        else if (!ready_.empty())
+        {
+          task = std::move(ready_.front());
+          ready_.pop_front();
+        }
+        else
+          return;
+      }
+      if (job)
+        job();
+      else
+      {
+        task->fn();
+        finish(task);
+      }
+    }
   }
 
-  void operator=(const T& val)
+  void finish(const std::shared_ptr<Task>& task)
   {
-    for (std::size_t i = 0; i < cont.size(); ++i)
-      cont[i] = val;
+    std::lock_guard<std::mutex> lock(mutex_);
+    task->done = true;
+    for (auto& succ : task->successors)
+      if (--succ->pending == 0)
+        ready_.push_back(succ);
+    task->successors.clear();
+    accesses_.erase(std::remove_if(accesses_.begin(), accesses_.end(), [&task](const Access& a) {return a.task == task;}), accesses_.end());
+
+    in_flight_--;
+    cv_.notify_all();
+    cv_idle_.notify_all();
   }
 
-  ExprVector& operator=(std::initializer_list<T> other)
+  // Makes task wait for prev, unless prev already finished (called with mutex_ locked)
+  static void depend(const std::shared_ptr<Task>& task, const std::shared_ptr<Task>& prev)
   {
-   try_resize_if_needed(other.size());
-   for (std::size_t i = 0; i < cont.size(); ++i)
-      cont[i] = (other.begin())[i];
-    return *this;
+    if (prev && prev != task && !prev->done)
+    {
+      prev->successors.push_back(task);
+      task->pending++;
+    }
   }
 
-  // size of underlying container
-  inline std::size_t size() const
+public:
+  static constexpr size_t npos = size_t(-1);
+
+  explicit ExprVectorExecutor(size_t nthreads = 0)
   {
-    return cont.size();
+    if (nthreads == 0)
+      nthreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    local_.resize(nthreads);
+    for (size_t i = 0; i < nthreads; i++)
+      workers_.emplace_back([this, i]{ worker(i); });
   }
 
-  // index operators
-  inline T operator[](const std::size_t i) const
+  ExprVectorExecutor(const ExprVectorExecutor&) = delete;
+  ExprVectorExecutor& operator=(const ExprVectorExecutor&) = delete;
+
+  ~ExprVectorExecutor()
   {
-    return cont[i];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& w : workers_)
+      w.join();
   }
 
-  inline T& operator[](const std::size_t i)
+  // Executor shared by the whole library
+  static ExprVectorExecutor& instance() {static ExprVectorExecutor executor; return executor;}
+
+  inline std::size_t size() const
   {
-    return cont[i];
+    return workers_.size();
   }
 
-  // Negative of ExprVector
-  inline ExprVector<T, ExprVectorNeg<T, Cont> > operator-() {return ExprVector<T, ExprVectorNeg<T, Cont>>(ExprVectorNeg<T, Cont>(contents()));}
-
-#if __GNUC__ < 6 || (__GNUC__ == 6 && __GNUC_MINOR__ <= 1)  // Old compiler
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::initializer_list<long> start_end_step)
+  // Runs fn after every previous task writing memory overlapping "reads", or reading/writing memory overlapping "writes"
+  template<typename F>
+  std::future<decltype(std::declval<F&>()())> submit(F fn, const std::vector<Span>& writes, const std::vector<Span>& reads)
   {
-    using namespace expr_vector_default_index;
-    long start  = start_end_step.begin()[0];
-    long end    = start_end_step.begin()[1];
-    long step   = start_end_step.begin()[2];
+    using R = decltype(fn());
+    auto job = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+    std::future<R> fut = job->get_future();
 
-    DI x;
+    auto task = std::make_shared<Task>();
+    task->fn = [job]{ (*job)(); };
 
-    if (start_end_step.size() == 3)
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const Access& a : accesses_)
     {
-      if (start == _ && end == _ && step == _)
-        return operator[](std::make_tuple(x,x,x)); //return [](std::make_tuple<DI,DI,DI>(x,x,x));
-      if (start == _ && end == _ && step != _)
-        return operator[](std::make_tuple(x,x,step)); //return [](std::make_tuple<DI,DI,long>(x,x,step));
-      if (start == _ && end != _ && step == _)
-        return operator[](std::make_tuple(x,end,x)); //return [](std::make_tuple<DI,long,DI>(x,end,x));
-      if (start == _ && end != _ && step != _)
-        return operator[](std::make_tuple(x,end,step)); //return [](std::make_tuple<DI,long,long>(x,end,step));
-
-      if (start != _ && end == _ && step == _)
-        return operator[](std::make_tuple(start,x,x)); //return [](std::make_tuple<long,DI,DI>(start,x,x));
-      if (start != _ && end == _ && step != _)
-        return operator[](std::make_tuple(start,x,step)); //return [](std::make_tuple<long,DI,long>(start,x,step));
-      if (start != _ && end != _ && step == _)
-        return operator[](std::make_tuple(start,end,x));  //return [](std::make_tuple<long,long,DI>(start,end,x));
-      if (start != _ && end != _ && step != _)
-        return operator[](std::make_tuple(start,end,step));  //return [](std::make_tuple<long,long,long>(start,end,step));
+      bool conflict = false;
+      for (const Span& w : writes)
+        conflict = conflict || a.span.overlaps(w);
+      for (const Span& r : reads)
+        conflict = conflict || (a.write && a.span.overlaps(r));
+      if (conflict)
+        depend(task, a.task);
     }
-    else
+    for (const Span& w : writes)
+      accesses_.push_back(Access{task, w, true});
+    for (const Span& r : reads)
+      accesses_.push_back(Access{task, r, false});
+
+    in_flight_++;
+    if (task->pending == 0)
     {
-      if (start == _ && end == _)
-        return operator[](std::make_tuple(x,x)); //return [](std::make_tuple<DI,DI>(x,x));
-      if (start == _ && end != _)
-        return operator[](std::make_tuple(x,end)); //return [](std::make_tuple<DI,long>(x,end));
-      if (start != _ && end == _)
-        return operator[](std::make_tuple(start,x)); //return [](std::make_tuple<long,DI>(start,x));
-      if (start != _ && end != _)
-        return operator[](std::make_tuple(start,end));  //return [](std::make_tuple<long,long>(start,end));
+      ready_.push_back(task);
+      cv_.notify_one();
     }
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) ); // This could not be executed
+    return fut;
   }
-#endif  
 
-
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,DI,DI> start_end_step)
+  // Blocks until every submitted task has finished
+  void wait_all()
   {
-    long start = 0;
-    long end = size();
-    long step = 1;
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_idle_.wait(lock, [this]{ return in_flight_ == 0; });
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,DI,long> start_end_step)
+  // Vectors shorter than this are processed by the calling thread in parallel_for
+  void set_min_parallel_size(size_t n) {min_parallel_size_ = n;}
+
+  // Elements of type T in a memory page, the granularity of chunks touching NUMA placed buffers
+  // Index of the worker running the calling thread, or npos outside of any executor
+  static size_t worker_index() {return current_worker();}
+
+  template<typename T>
+  static constexpr size_t page_elements() {return sizeof(T) >= 4096 ? 1 : 4096 / sizeof(T);}
+
+  // Start of chunk k when [0,n) is split into "parts" chunks whose boundaries are multiples of "align"
+  static inline size_t chunk_begin(size_t n, size_t k, size_t parts, size_t align = 1)
   {
-    long start;
-    long end;
-    long step = std::get<2>(start_end_step);
+    if (k >= parts)
+      return n;
+    size_t b = n / parts * k + n % parts * k / parts;
+    b = b / align * align;
+    return std::min(b, n);
+  }
 
-    if (step > 0)
+  // Calls fn(begin, end) over [0,n), chunk k always being run by worker k.
+  // Memory first touched through parallel_for is then local to the worker evaluating it
+  template<typename F>
+  void parallel_for(size_t n, F fn, size_t align = 1)
+  {
+    size_t parts = size();
+    if (parts <= 1 || n < min_parallel_size_ || current_worker() != npos)
     {
-      start = 0;
-      end = size();
+      if (n > 0)
+        fn(size_t(0), n);
+      return;
     }
-    else
+
+    std::mutex m;
+    std::condition_variable cv_done;
+    size_t remaining = parts;
+    std::exception_ptr error;
+
     {
-      start = size()-1;
-      end = -1;
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t k = 0; k < parts; k++)
+      {
+        size_t b = chunk_begin(n, k, parts, align);
+        size_t e = chunk_begin(n, k+1, parts, align);
+        local_[k].push_back([&, b, e]
+        {
+          try
+          {
+            if (b < e)
+              fn(b, e);
+          }
+          catch (...)
+          {
+            std::lock_guard<std::mutex> lk(m);
+            error = std::current_exception();
+          }
+          std::lock_guard<std::mutex> lk(m);
+          if (--remaining == 0)
+            cv_done.notify_one();
+        });
+      }
     }
+    cv_.notify_all();
 
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+    std::unique_lock<std::mutex> lk(m);
+    cv_done.wait(lk, [&]{ return remaining == 0; });
+    if (error)
+      std::rethrow_exception(error);
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,long,DI> start_end_step)
+  // Numbers listed in the Linux format "0-3,8,10-11"
+  static std::vector<int> parse_list(const std::string& text)
   {
-    long start = 0;
-    long end = std::get<1>(start_end_step);
-    long step = 1;
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+    std::vector<int> values;
+    std::string range;
+    std::stringstream list(text);
+    while (std::getline(list, range, ','))
+    {
+      int first = 0, last = 0;
+      char dash = 0;
+      std::stringstream ss(range);
+      if (!(ss >> first))
+        continue;
+      last = first;
+      if (ss >> dash >> last && dash != '-')
+        last = first;
+      for (int c = first; c <= last; c++)
+        values.push_back(c);
+    }
+    return values;
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,long,long> start_end_step)
+  struct NumaNode
   {
-    long start;
-    long end = std::get<1>(start_end_step);
-    long step = std::get<2>(start_end_step);
-
-    if (step > 0)
-      start = 0;
-    else
-      start = size()-1;
+    int id;                 // node id of the kernel (ids may have gaps)
+    std::vector<int> cpus;  // empty for nodes with memory only
+  };
 
-    while (end < 0)
-      end += size();
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  // Online NUMA nodes and their CPUs (a single node 0 with every CPU if the topology is unknown)
+  static std::vector<NumaNode> numa_nodes()
+  {
+    std::vector<NumaNode> nodes;
+#if defined(__linux__)
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string text;
+    if (online && std::getline(online, text))
+      for (int id : parse_list(text))
+      {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        std::string cpus;
+        std::getline(f, cpus);
+        nodes.push_back(NumaNode{id, parse_list(cpus)});
+      }
+#endif
+    bool any_cpu = false;
+    for (auto& node : nodes)
+      any_cpu = any_cpu || !node.cpus.empty();
+    if (!any_cpu)
+    {
+      nodes.assign(1, NumaNode{0, {}});
+      for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++)
+        nodes[0].cpus.push_back(int(c));
+    }
+    return nodes;
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,DI,DI> start_end_step)
+  // Pins each worker to one CPU, filling NUMA node 0 first, so consecutive parallel_for chunks
+  // are computed (and first touched) on the same node. Returns false if pinning is not supported
+  bool pin_threads()
   {
-    long start = std::get<0>(start_end_step);
-    long end = size();
-    long step = 1;
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+#if defined(__linux__)
+    std::vector<int> cpus;
+    for (auto& node : numa_nodes())
+      cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+
+    bool ok = true;
+    for (size_t k = 0; k < workers_.size(); k++)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[k * cpus.size() / workers_.size()], &set);
+      ok = pthread_setaffinity_np(workers_[k].native_handle(), sizeof(set), &set) == 0 && ok;
+    }
+    return ok;
+#else
+    return false;
+#endif
   }
+};
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,DI,long> start_end_step)
+
+namespace ev
+{
+  // Position where the last search of an expression node ended, so the next search starts there. It is kept by
+  // the node, with one position per worker of the executor (and one for the other threads), each in its own
+  // cache line: a worker continues from where its own chunk stopped. A position is only written when it changes
+  class search_hint
   {
-    long start  = std::get<0>(start_end_step);
-    long end;
-    long step   = std::get<2>(start_end_step);
+  public:
+    struct position
+    {
+      std::atomic<std::size_t> value;
 
-    if (step > 0)
-       end = size();
-    else
-      end = -1;
+      inline std::size_t get() const {return value.load(std::memory_order_relaxed);}
 
-    while (start < 0)
-      start += size();
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
-  }
+      inline void set(std::size_t p)
+      {
+        if (get() != p)
+          value.store(p, std::memory_order_relaxed);
+      }
+    };
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,long,DI> start_end_step)
-  {
-    long start  = std::get<0>(start_end_step);
-    long end    = std::get<1>(start_end_step);
-    long step   = 1;
-    while (start < 0)
-      start += size();
-    while (end < 0)
-      end += size();
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
-  }  
+  private:
+    static constexpr std::size_t slots = 16, stride = 64 / sizeof(position);
+    std::unique_ptr<position[]> pos_;
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,long,long> start_end_step)
+  public:
+    search_hint() : pos_(new position[slots * stride]()) {}
+    search_hint(const search_hint&) : search_hint() {}
+
+    // Position of the calling thread
+    inline position& local() const {return pos_[(ExprVectorExecutor::worker_index() + 1) % slots * stride];}
+  };
+
+  // Size of the last level cache in bytes (32 MiB if it can't be read)
+  inline std::size_t last_level_cache_size()
   {
-    long start  = std::get<0>(start_end_step);
-    long end    = std::get<1>(start_end_step);
-    long step   = std::get<2>(start_end_step);
-    while (start < 0)
-      start += size();
-    while (end < 0)
-      end += size();
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+    long bytes = 0;
+#if defined(__linux__) && defined(_SC_LEVEL3_CACHE_SIZE)
+    bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (bytes <= 0)
+      bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    return bytes > 0 ? std::size_t(bytes) : std::size_t(32) << 20;
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,DI> start_end)
+  // A static member of a template, so the header can define it. It is constant initialized, so it is valid during
+  // the dynamic initialization of other globals too, and holds "unset" until the first read fills it in
+  template<typename Tag = void>
+  struct stream_settings
   {
-    long start  = 0;
-    long end = size();
-    long step = 1;
+    static constexpr std::size_t unset = 1;     // streams the same vectors as 0, which set_stream_threshold() stores instead
+    static std::atomic<std::size_t> threshold;
+  };
 
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
-  }
+  template<typename Tag>
+  constexpr std::size_t stream_settings<Tag>::unset;
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,long> start_end)
-  {
-    long start  = 0;
-    long end = std::get<1>(start_end);
-    long step = 1;
+  template<typename Tag>
+  std::atomic<std::size_t> stream_settings<Tag>::threshold(stream_settings<Tag>::unset);
 
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  // Assignments whose destination has at least this many bytes use streaming stores, which don't read the
+  // destination lines before writing them and don't evict the operands from the cache. Default: the size of
+  // the last level cache (a destination that big evicts everything anyway)
+  inline std::size_t stream_threshold()
+  {
+    std::size_t t = stream_settings<>::threshold.load(std::memory_order_relaxed);
+    if (t == stream_settings<>::unset)
+    {
+      std::size_t expected = t;
+      t = last_level_cache_size();
+      if (!stream_settings<>::threshold.compare_exchange_strong(expected, t, std::memory_order_relaxed))
+        t = expected;
+    }
+    return t;
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,DI> start_end)
+  // Use SIZE_MAX to never stream automatically, or 0 to always stream
+  inline void set_stream_threshold(std::size_t bytes)
   {
-    long start  = std::get<0>(start_end);
-    long end = size();
-    long step = 1;
-
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+    stream_settings<>::threshold.store(bytes == stream_settings<>::unset ? 0 : bytes, std::memory_order_relaxed);
   }
 
-  // Slice of ExprVector
-  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,long> start_end)
+#if EXPR_VECTOR_STREAM
+  // Non-temporal store of Bytes bytes from src to dst, both aligned to Bytes
+  template<std::size_t Bytes>
+  struct stream_store;
+
+  template<>
+  struct stream_store<16>
   {
-    long start  = std::get<0>(start_end);
-    long end    = std::get<1>(start_end);
-    long step   = 1;
-    while (start < 0)
-      start += size();
-    while (end < 0)
-      end += size();
-    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
-  }
+    static inline void copy(void* dst, const void* src)
+    {
+      _mm_stream_si128(static_cast<__m128i*>(dst), _mm_load_si128(static_cast<const __m128i*>(src)));
+    }
+  };
 
-  inline T sum()
+#if defined(__AVX__) || EXPR_VECTOR_DISPATCH
+  template<>
+  struct stream_store<32>
   {
-    if (size() == 0)
+#if defined(__AVX__)
+    static inline void copy(void* dst, const void* src)
+#else
+    static inline __attribute__((target("avx"))) void copy(void* dst, const void* src)
+#endif
     {
-      throw std::logic_error("ExprVector::sum() called with zero length buffer");
+      _mm256_stream_si256(static_cast<__m256i*>(dst), _mm256_load_si256(static_cast<const __m256i*>(src)));
     }
-    T val = cont[0];
-    for (size_t i=1; i<size(); i++)
-      val = val + cont[i];   // += not used because the base class could not have defined it
-    return val;
-  }
+  };
+#endif
 
-  inline size_t count(const T& val)
+  // Streaming stores are weakly ordered: they must be fenced before other threads can see them
+  inline void stream_fence() {_mm_sfence();}
+#else
+  // Regular stores, so the streaming loops compile (they are not used, see ev::streamable)
+  template<std::size_t Bytes>
+  struct stream_store
   {
-    size_t amount = 0;
-    for (size_t i=0; i<size(); i++)
-      amount += (cont[i] == val);
-    return amount;
-  }
+    static inline void copy(void* dst, const void* src) {std::memcpy(dst, src, Bytes);}
+  };
 
-  // returns the underlying data
-  inline const Cont& contents() const
+  inline void stream_fence() {}
+#endif
+}
+
+// Instruction sets the evaluation loops are compiled for, when EXPR_VECTOR_DISPATCH is 1
+enum class ExprVectorIsa
+{
+  Baseline,   // the target of the build
+  Sse42,
+  Avx2,       // AVX2 and FMA
+  Avx512      // AVX-512 F, BW, DQ and VL
+};
+
+namespace ev
+{
+  // Best instruction set of the CPU. The environment variable EXPR_VECTOR_ISA (baseline, sse4.2, avx2 or avx512)
+  // lowers it, to test the other loops on the same machine
+  inline ExprVectorIsa detect_isa()
   {
-    return cont;
+    ExprVectorIsa best = ExprVectorIsa::Baseline;
+#if EXPR_VECTOR_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+      best = ExprVectorIsa::Avx512;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      best = ExprVectorIsa::Avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+      best = ExprVectorIsa::Sse42;
+#endif
+    const char* env = std::getenv("EXPR_VECTOR_ISA");
+    if (env && *env)
+    {
+      static const std::map<std::string, ExprVectorIsa> names = {{"baseline", ExprVectorIsa::Baseline}, {"sse4.2", ExprVectorIsa::Sse42},
+                                                                 {"avx2", ExprVectorIsa::Avx2}, {"avx512", ExprVectorIsa::Avx512}};
+      auto it = names.find(env);
+      if (it == names.end())
+        std::cerr << "EXPR_VECTOR_ISA: unknown instruction set " << env << std::endl;
+      else if (it->second < best)
+        best = it->second;
+    }
+    return best;
   }
 
-  inline Cont& contents()
+  // Instruction set of the evaluation loops, detected at first use
+  inline ExprVectorIsa isa()
   {
-    return cont;
+    static const ExprVectorIsa detected = detect_isa();
+    return detected;
   }
 
-  inline T* data()
+  inline const char* isa_name(ExprVectorIsa isa)
   {
-    return cont.data();
+    switch (isa)
+    {
+      case ExprVectorIsa::Sse42:  return "sse4.2";
+      case ExprVectorIsa::Avx2:   return "avx2";
+      case ExprVectorIsa::Avx512: return "avx512";
+      default:                    return "baseline";
+    }
   }
 
-  inline T* begin()
+  // Evaluation loops, compiled for one target. The expression is inlined into them, so every expression
+  // shape gets a version per target. STREAM_BYTES is the width of the streaming stores of the target
+#define EXPR_VECTOR_KERNELS(SUFFIX, ATTRIBUTES, STREAM_BYTES)                                       \
+  template<typename C, typename E>                                                                  \
+  ATTRIBUTES void assign_loop##SUFFIX(C& cont, const E& other, std::size_t b, std::size_t e)       \
+  {                                                                                                 \
+    for (std::size_t i = b; i < e; ++i)                                                             \
+      cont[i] = other[i];                                                                           \
+  }                                                                                                 \
+                                                                                                    \
+  template<typename T, typename E>                                                                  \
+  ATTRIBUTES void assign_blocked##SUFFIX(T* out, const E& other, std::size_t n)                     \
+  {                                                                                                 \
+    const std::size_t block_size = 256;                                                             \
+    T block[block_size];                                                                            \
+    for (std::size_t start = 0; start < n; start += block_size)                                     \
+    {                                                                                               \
+      std::size_t len = std::min(block_size, n - start);                                            \
+      for (std::size_t j = 0; j < len; j++)                                                         \
+        block[j] = other[start + j];                                                                \
+      std::memcpy(out + start, block, len * sizeof(T));                                             \
+    }                                                                                               \
+  }                                                                                                 \
+                                                                                                    \
+  template<typename T, typename E>                                                                  \
+  ATTRIBUTES void assign_streaming##SUFFIX(T* out, const E& other, std::size_t b, std::size_t e)    \
+  {                                                                                                 \
+    constexpr std::size_t bytes = STREAM_BYTES, line = 64, width = line / sizeof(T);                \
+    alignas(line) T v[width];                                                                       \
+    std::size_t i = b;                                                                              \
+    for (; i < e && reinterpret_cast<std::uintptr_t>(out + i) % line != 0; ++i)                     \
+      out[i] = other[i];                                                                            \
+    for (; e - i >= width; i += width)                                                              \
+    {                                                                                               \
+      for (std::size_t j = 0; j < width; j++)                                                       \
+        v[j] = other[i + j];                                                                        \
+      for (std::size_t k = 0; k < width; k += bytes / sizeof(T))                                    \
+        stream_store<bytes>::copy(out + i + k, v + k);                                              \
+    }                                                                                               \
+    for (; i < e; ++i)                                                                              \
+      out[i] = other[i];                                                                            \
+    stream_fence();                                                                                 \
+  }                                                                                                 \
+                                                                                                    \
+  template<typename T, typename C>                                                                  \
+  ATTRIBUTES T sum_loop##SUFFIX(const C& cont, std::size_t n)                                       \
+  {                                                                                                 \
+    T val = cont[0];                                                                                \
+    for (std::size_t i = 1; i < n; i++)                                                             \
+      val = val + cont[i];   /* += not used because the base class could not have defined it */    \
+    return val;                                                                                     \
+  }                                                                                                 \
+                                                                                                    \
+  template<typename T, typename C>                                                                  \
+  ATTRIBUTES std::size_t count_loop##SUFFIX(const C& cont, std::size_t n, const T& val)             \
+  {                                                                                                 \
+    std::size_t amount = 0;                                                                         \
+    for (std::size_t i = 0; i < n; i++)                                                             \
+      amount += (cont[i] == val);                                                                   \
+    return amount;                                                                                  \
+  }
+
+  // The loops don't contract a*b + c into FMA instructions on their own (GCC does with -ffp-contract=fast, the
+  // default of the GNU modes, when the target has FMA): EXPR_VECTOR_FMA decides, whatever the target
+#if defined(__GNUC__) && !defined(__clang__)
+#define EXPR_VECTOR_TARGET(ISA) __attribute__((target(ISA), optimize("fp-contract=off")))
+#define EXPR_VECTOR_BASELINE inline __attribute__((optimize("fp-contract=off")))
+#elif defined(__clang__)
+#define EXPR_VECTOR_TARGET(ISA) __attribute__((target(ISA)))
+#define EXPR_VECTOR_BASELINE inline
+#else
+#define EXPR_VECTOR_BASELINE inline
+#endif
+
+#if defined(__AVX__)
+  EXPR_VECTOR_KERNELS(_baseline, EXPR_VECTOR_BASELINE, 32)
+#else
+  EXPR_VECTOR_KERNELS(_baseline, EXPR_VECTOR_BASELINE, 16)
+#endif
+#if EXPR_VECTOR_DISPATCH
+  EXPR_VECTOR_KERNELS(_sse42, EXPR_VECTOR_TARGET("sse4.2"), 16)
+  EXPR_VECTOR_KERNELS(_avx2, EXPR_VECTOR_TARGET("avx2,fma"), 32)
+  EXPR_VECTOR_KERNELS(_avx512, EXPR_VECTOR_TARGET("avx512f,avx512bw,avx512dq,avx512vl"), 32)
+
+#define EXPR_VECTOR_DISPATCH_ISA(NAME, ARGS)                                                        \
+  switch (isa())                                                                                    \
+  {                                                                                                 \
+    case ExprVectorIsa::Avx512: return NAME##_avx512 ARGS;                                          \
+    case ExprVectorIsa::Avx2:   return NAME##_avx2 ARGS;                                            \
+    case ExprVectorIsa::Sse42:  return NAME##_sse42 ARGS;                                           \
+    default:                    return NAME##_baseline ARGS;                                        \
+  }
+#else
+#define EXPR_VECTOR_DISPATCH_ISA(NAME, ARGS) return NAME##_baseline ARGS;
+#endif
+
+  // cont[i] = other[i] for i in [b, e)
+  template<typename C, typename E>
+  inline void assign_loop(C& cont, const E& other, std::size_t b, std::size_t e)
   {
-    return cont.data();
+    EXPR_VECTOR_DISPATCH_ISA(assign_loop, (cont, other, b, e))
   }
 
-  inline T* end()
+  // out[i] = other[i] for i in [0, n), by blocks (see ExprVector::assign_elements)
+  template<typename T, typename E>
+  inline void assign_blocked(T* out, const E& other, std::size_t n)
   {
-    return cont.data() + cont.size();
+    EXPR_VECTOR_DISPATCH_ISA(assign_blocked, (out, other, n))
   }
 
-  std::vector<T> vect() {size_t n = size(); std::vector<T> v(n); for (size_t i=0; i<n; i++) v[i] = (*this)[i]; return v;}
+  // out[i] = other[i] for i in [b, e), with streaming stores (see ExprVector::assign_streaming)
+  template<typename T, typename E>
+  inline void assign_streaming(T* out, const E& other, std::size_t b, std::size_t e)
+  {
+    EXPR_VECTOR_DISPATCH_ISA(assign_streaming, (out, other, b, e))
+  }
 
-  ExprVector<T,BuffDataExt<T>> toExt() {ExprVector<T,BuffDataExt<T>> ret; ret.setBuffer(data(), size()); return ret;}
+  template<typename T, typename C>
+  inline T sum_loop(const C& cont, std::size_t n)
+  {
+    EXPR_VECTOR_DISPATCH_ISA(sum_loop, <T>(cont, n))
+  }
 
-  static ExprVector zeros(size_t n) {ExprVector v(n,0); return v;}
-  static ExprVector linspace(T start, T stop, long n) {ExprVector v(n); for (size_t i=0; i<n; i++) v[i] = start + i * (stop-start)/(n-1); return v;}
-  //static ExprVector arange(T start, T stop, T step=1) {long n = (stop - start + step - 1) / step; if (n<=0) return ExprVector(0); ExprVector v(n); for (size_t i=0; i<n; i++) v[i] = start + step * i; return v;}
-  static ExprVector arange(T start, T stop, T step=1) {long n = int(ceil((stop - start) / step)); if (n<=0) return ExprVector(0); ExprVector v(n); for (size_t i=0; i<n; i++) v[i] = start + step * i; return v;}
-  static ExprVector arange(T stop) {return arange(0, stop, 1);}
-  static ExprVector iota(T start, T stop) {return arange(start, stop);}
+  template<typename T, typename C>
+  inline std::size_t count_loop(const C& cont, std::size_t n, const T& val)
+  {
+    EXPR_VECTOR_DISPATCH_ISA(count_loop, (cont, n, val))
+  }
+}
 
-  static bool plot_py (const ExprVector& x, const ExprVector& y) {std::stringstream ss; ss << "python -c \"" << "import matplotlib.pyplot as plt; plt.plot(" << x << ", " << y <<"); plt.show()\""; int ret = system(ss.str().c_str()); if (ret != 0) return false; return true;}
-  static bool plot_py2(const ExprVector& x, const ExprVector& y) {std::stringstream ss; ss << "python2 -c \"" << "import matplotlib.pyplot as plt; plt.plot(" << x << ", " << y <<"); plt.show()\""; int ret = system(ss.str().c_str()); if (ret != 0) return false; return true;}
-  static bool plot_py3(const ExprVector& x, const ExprVector& y) {std::stringstream ss; ss << "python3 -c \"" << "import matplotlib.pyplot as plt; plt.plot(" << x << ", " << y <<"); plt.show()\""; int ret = system(ss.str().c_str()); if (ret != 0) return false; return true;}
 
-  static void plot(const ExprVector& x, const ExprVector& y) { if (!plot_py(x,y) && !plot_py3(x,y) && !plot_py2(x,y)) std::cout << "python+matplotlib was not found for plotting, or too much points to plot" << std::endl;}
-  static void plot(const std::vector<T>& x, const std::vector<T>& y) {ExprVector<T, BuffDataExt<T>> xx; ExprVector<T, BuffDataExt<T>> yy; xx.setBuffer(x.data(),x.size()); yy.setBuffer(y.data(),y.size()); plot(xx,yy);}
+enum class ExprVectorNumaPolicy
+{
+  FirstTouch,   // pages are placed on the node of the worker which first writes them
+  Interleave,   // pages are interleaved between all of the nodes
+  Bind          // pages are placed on a single node
 };
 
-template <typename T, typename Cont>
-std::ostream& operator<<(std::ostream& os, const ExprVector<T,Cont> & ev)
+
+/** BuffDataNuma is an owning buffer whose pages are first touched in parallel, using the same chunks
+    as ExprVectorExecutor::parallel_for, or placed by a NUMA memory policy (Linux mbind) **/
+template<typename T>
+class BuffDataNuma
 {
-  os << "[";
-  if (ev.size() > 0)
+  static_assert(std::is_trivially_copyable<T>::value, "BuffDataNuma requires a trivially copyable type");
+
+  T* buffer_ = nullptr;
+  size_t n_ = 0;
+  ExprVectorNumaPolicy policy_ = ExprVectorNumaPolicy::FirstTouch;
+  int node_ = 0;
+
+  static T* allocate(size_t n)
   {
-    os << ev[0];
-    for (size_t i = 1; i < ev.size(); i++)
-      os << ", " << ev[i];
+    if (n == 0)
+      return nullptr;
+#if defined(__linux__)
+    void* p = mmap(nullptr, n*sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    return static_cast<T*>(p);
+#else
+    return static_cast<T*>(::operator new(n*sizeof(T)));
+#endif
   }
-  os << "]";
-  return os;
-}
 
-template <typename Cont>
-std::ostream& operator<<(std::ostream& os, const ExprVector<std::string,Cont> & ev)
-{
-  os << "[\"";
-  if (ev.size() > 0)
+  static void release(T* p, size_t n)
   {
-    os << ev[0];
-    for (size_t i = 1; i < ev.size(); i++)
-      os << "\", \"" << ev[i];
+    if (p == nullptr)
+      return;
+#if defined(__linux__)
+    munmap(p, n*sizeof(T));
+#else
+    (void)n;
+    ::operator delete(p);
+#endif
   }
-  os << "\"]";
-  return os;
-}
 
+  // Applies the memory policy to untouched pages (first touch needs nothing)
+  void place(T* p, size_t n) const
+  {
+#if defined(__linux__) && defined(SYS_mbind)
+    if (p == nullptr || policy_ == ExprVectorNumaPolicy::FirstTouch)
+      return;
+    const int mpol_bind = 2, mpol_interleave = 3;
+    unsigned long mask[16] = {0};
+    const size_t bits = 8*sizeof(unsigned long);
+    if (policy_ == ExprVectorNumaPolicy::Bind)
+    {
+      if (node_ < 0 || size_t(node_) >= 16*bits)
+        return;
+      mask[node_ / bits] |= 1ul << (node_ % bits);
+    }
+    else
+      for (auto& node : ExprVectorExecutor::numa_nodes())
+        if (node.id >= 0 && size_t(node.id) < 16*bits)
+          mask[node.id / bits] |= 1ul << (node.id % bits);
+    syscall(SYS_mbind, p, n*sizeof(T), policy_ == ExprVectorNumaPolicy::Bind ? mpol_bind : mpol_interleave, mask, 16*bits, 0);  // best effort
+#else
+    (void)p; (void)n;
+#endif
+  }
 
-#define ADD_EXPR_VECT_OPERATOR_2_ARGS(NAME, OP)                                   \
-                                                                                  \
-template<typename T, typename Op1, typename Op2>                                  \
-class NAME                                                                        \
-{                                                                                 \
-  const Op1& op1;                                                                 \
-  const Op2& op2;                                                                 \
-                                                                                  \
-public:                                                                           \
-  using type = decltype(op1[0] OP op2[0]);                                        \
-  NAME(const Op1& a, const Op2& b) : op1(a), op2(b) {}                            \
-                                                                                  \
-  inline type operator[](const std::size_t i) const                               \
-  {                                                                               \
-    return op1[i] OP op2[i];                                                      \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op1.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-                                                                                  \
-template<typename T, typename R1, typename R2>                                    \
-inline ExprVector<typename NAME<T, R1, R2>::type, NAME<T, R1, R2> >               \
-operator OP (const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)              \
-{                                                                                 \
-  return ExprVector<typename NAME<T, R1, R2>::type, NAME<T, R1, R2> >(NAME<T, R1, R2 >(a.contents(), b.contents()));   \
-}                                                                                 \
+  // Creates a buffer of n elements, touching chunk k from worker k. fill(i) returns element i
+  template<typename F>
+  void rebuild(size_t n, F fill)
+  {
+    T* p = allocate(n);
+    place(p, n);
+    ExprVectorExecutor::instance().parallel_for(n, [&](size_t b, size_t e)
+    {
+      for (size_t i = b; i < e; i++)
+        p[i] = fill(i);
+    }, ExprVectorExecutor::page_elements<T>());
+    release(buffer_, n_);
+    buffer_ = p;
+    n_ = n;
+  }
 
+public:
+  BuffDataNuma() {}
+  explicit BuffDataNuma(size_t n) {resize(n);}
+  BuffDataNuma(size_t n, const T& value) {rebuild(n, [&](size_t) {return value;});}
+  BuffDataNuma(const BuffDataNuma& other) : policy_(other.policy_), node_(other.node_) {rebuild(other.n_, [&](size_t i) {return other.buffer_[i];});}
+  BuffDataNuma(BuffDataNuma&& other) noexcept : buffer_(other.buffer_), n_(other.n_), policy_(other.policy_), node_(other.node_) {other.buffer_ = nullptr; other.n_ = 0;}
+  ~BuffDataNuma() {release(buffer_, n_);}
 
+  BuffDataNuma& operator=(const BuffDataNuma& other) {if (this != &other) {policy_ = other.policy_; node_ = other.node_; rebuild(other.n_, [&](size_t i) {return other.buffer_[i];});} return *this;}
+  BuffDataNuma& operator=(BuffDataNuma&& other) noexcept {std::swap(buffer_, other.buffer_); std::swap(n_, other.n_); policy_ = other.policy_; node_ = other.node_; return *this;}
 
-#define ADD_EXPR_VECT_PRE_OP(NAME, OP)                                            \
-template<typename T, typename Op2>                                                \
-class NAME                                                                        \
-{                                                                                 \
-  const T val1;                                                                   \
-  const Op2& op2;                                                                 \
-                                                                                  \
-public:                                                                           \
-  NAME(T a, const Op2& b) : val1(a), op2(b) {}                                    \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
-  {                                                                               \
-    return val1 OP op2[i];                                                        \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op2.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-template<typename T, typename R2>                                                 \
-inline ExprVector<T, NAME<T, R2> >                                                \
-operator OP(T a, const ExprVector<T, R2>& b)                                      \
-{                                                                                 \
-  return ExprVector<T, NAME<T, R2> >(NAME<T, R2 >(a, b.contents()));              \
-}                                                                                 \
+  // Sets the placement used by the next allocation (node, a kernel node id, is used only by ExprVectorNumaPolicy::Bind)
+  void setPolicy(ExprVectorNumaPolicy policy, int node = 0) {policy_ = policy; node_ = node;}
 
+  void resize(size_t n)
+  {
+    T* old = buffer_;
+    size_t n_old = n_;
+    rebuild(n, [&](size_t i) {return i < n_old ? old[i] : T();});
+  }
 
+  inline T operator[](const std::size_t i) const
+  {
+    return buffer_[i];
+  }
 
-#define ADD_EXPR_VECT_POST_OP(NAME, OP)                                           \
-template<typename T, typename Op1>                                                \
-class NAME                                                                        \
-{                                                                                 \
-  const Op1& op1;                                                                 \
-  const T val2;                                                                   \
-                                                                                  \
-public:                                                                           \
-  NAME(const Op1& a, T b) : op1(a), val2(b) {}                                    \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
-  {                                                                               \
-    return op1[i] OP val2;                                                        \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op1.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-template<typename T, typename R1>                                                 \
-inline ExprVector<T, NAME<T, R1> >                                                \
-operator OP(const ExprVector<T, R1>& a, T b)                                      \
-{                                                                                 \
-  return ExprVector<T, NAME<T, R1> >(NAME<T, R1 >(a.contents(), b));              \
-}                                                                                 
+  inline T& operator[](const std::size_t i)
+  {
+    return buffer_[i];
+  }
 
+  inline T* data() {return buffer_;}
+  inline const T* data() const {return buffer_;}
 
+  inline std::size_t size() const
+  {
+    return n_;
+  }
+};
 
-#define ADD_EXPR_VECT_PRE_SCALAR(NAME, OP, TYPE)                                  \
-template<typename T, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>   \
-class NAME                                                                        \
-{                                                                                 \
-  const TYPE val1;                                                                \
-  const Op2& op2;                                                                 \
-                                                                                  \
-public:                                                                           \
-  NAME(TYPE a, const Op2& b) : val1(a), op2(b) {}                                 \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
-  {                                                                               \
-    return val1 OP op2[i];                                                        \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op2.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-template<typename T, typename R2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>    \
-inline ExprVector<T, NAME<T, R2> >                                                \
-operator OP(TYPE a, const ExprVector<T, R2>& b)                                   \
-{                                                                                 \
-  return ExprVector<T, NAME<T, R2> >(NAME<T, R2 >(a, b.contents()));              \
-}                                                                                 \
 
+template<typename T, typename Cont>
+class ExprVectorStream;
 
+/** ExprVector is the main class which represents a vector/buffer using expression templates */
+template<typename T, typename Cont = std::vector<T>>  //BuffDataExt<T> >
+class ExprVector
+{
+public:
+  Cont cont;
 
-#define ADD_EXPR_VECT_POST_SCALAR(NAME, OP, TYPE)                                 \
-template<typename T, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>   \
-class NAME                                                                        \
-{                                                                                 \
-  const Op2& op2;                                                                 \
-  const TYPE val1;                                                                \
-                                                                                  \
-public:                                                                           \
-  NAME(TYPE a, const Op2& b) : val1(a), op2(b) {}                                 \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
+  using DI = ExprVectorDefaultIndex;
+
+  // Empty constructed ExprVector must be given a buffer before being used
+  ExprVector() {}
+  
+  // ExprVector with initial size
+  ExprVector(const std::size_t n) : cont(n) {}
+
+  // ExprVector with initial size and value
+  ExprVector(const std::size_t n, const T initialValue) : cont(n, initialValue) {}
+
+  // Constructor for underlying container
+  ExprVector(const Cont& other) : cont(other) {}
+  ExprVector(Cont&& other) : cont(std::move(other)) {}
+
+  // Constructor from an expression, allocating once and evaluating it without zero filling first
+  template<typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<std::is_constructible<Cont2, ExprVectorIterator<T2, R2>, ExprVectorIterator<T2, R2>>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  explicit ExprVector(const ExprVector<T2, R2>& other) : cont(ExprVectorIterator<T2, R2>(other.contents(), 0), ExprVectorIterator<T2, R2>(other.contents(), other.size())) {}
+
+  template<typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<!std::is_constructible<Cont2, ExprVectorIterator<T2, R2>, ExprVectorIterator<T2, R2>>::value && ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  explicit ExprVector(const ExprVector<T2, R2>& other) {*this = other;}
+
+  template <typename T2>    //template <typename T2, typename std::enable_if<std::is_same<Cont, std::vector<T2>>::value, nullptr_t>::type = nullptr>
+  ExprVector(std::initializer_list<T2> other)
+  {
+    try_resize_if_needed(other.size());
+    for (std::size_t i = 0; i < cont.size(); ++i)
+      cont[i] = (other.begin())[i];
+  }
+
+  operator ExprVector<T, std::vector<T>>() const {return ExprVector<T, std::vector<T>>(std::vector<T>(ExprVectorIterator<T, Cont>(cont, 0), ExprVectorIterator<T, Cont>(cont, size())));}
+
+
+  template <typename Cont2=Cont, typename std::enable_if<ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>   //   template <typename T2=T, typename std::enable_if<!std::is_same<Cont, BuffDataExt<T2>>::value, nullptr_t>::type = nullptr>
+  void resize(size_t n) {cont.resize(n);}
+
+  template <typename T2=T, typename std::enable_if<std::is_same<Cont, BuffDataExt<T2>>::value && std::is_same<T,T2>::value, nullptr_t>::type = nullptr>
+  void setBuffer(T* buffer, size_t n) {cont.setBuffer(buffer,n);}
+
+  template <typename T2=T, typename std::enable_if<std::is_same<Cont, BuffDataExt<T2>>::value && std::is_same<T,T2>::value, nullptr_t>::type = nullptr>
+  void setBuffer(const T* buffer, size_t n) {cont.setBuffer(buffer,n);}  //!< Please don't modify an ExprVector after using this function
+
+  template <typename Cont2=Cont, typename std::enable_if<ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  inline void try_resize_if_needed(size_t n)
+  {
+    if (cont.size() == 0 || cont.size() != n)
+      cont.resize(n);
+  }
+
+  template <typename Cont2=Cont, typename std::enable_if<!ev::is_detected_exact<void, ev::has_resize, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>                 // template<typename T2=T, typename R2=Cont, typename std::enable_if<!std::is_same<Cont, std::vector<T2>>::value, nullptr_t>::type = nullptr>
+  inline void try_resize_if_needed(size_t n) {}
+
+  // If the size differs, reallocates cont with the values of other in one pass (no zero filling) and returns true
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<ev::is_detected<ev::has_assign, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  inline bool try_assign_resized(const ExprVector<T2, R2>& other)
+  {
+    if (cont.size() == other.size())
+      return false;
+    cont.assign(ExprVectorIterator<T2, R2>(other.contents(), 0), ExprVectorIterator<T2, R2>(other.contents(), other.size()));
+    return true;
+  }
+
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<!ev::is_detected<ev::has_assign, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  inline bool try_assign_resized(const ExprVector<T2, R2>& other)
+  {
+    try_resize_if_needed(other.size());
+    return false;
+  }
+
+  // Evaluation loop of the assignments
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<!(ev::fixed_size<Cont2>::value > 0 && ev::fixed_size<Cont2>::value <= 64) && !ev::byte_blocked<T, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  inline void assign_elements(const ExprVector<T2, R2>& other)
+  {
+    if (uses_streaming_stores())
+      return assign_streaming(other, 0, cont.size());
+    auto&& target = ev::loop_target(cont, 0, cont.size());
+    ev::assign_loop(target, other, 0, cont.size());
+  }
+
+  // Streaming stores: each cache line of elements is evaluated and written with non-temporal stores, so the
+  // destination lines are neither read before being written nor kept in the cache
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<ev::streamable<T, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  void assign_streaming(const ExprVector<T2, R2>& other, std::size_t begin, std::size_t end)
+  {
+    ev::assign_streaming(cont.data(), other, begin, end);
+  }
+
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<!ev::streamable<T, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  void assign_streaming(const ExprVector<T2, R2>& other, std::size_t begin, std::size_t end)
+  {
+    assign_range(other, begin, end);
+  }
+
+  // True if the assignments to this vector use streaming stores (see ev::stream_threshold()). A destination
+  // which must be resized first is written with regular stores
+  bool uses_streaming_stores() const
+  {
+    return ev::streamable<T, Cont>::value && cont.size() * sizeof(T) >= ev::stream_threshold();
+  }
+
+  // c.stream() = expr; assigns with streaming stores whatever the size (when the container supports them)
+  ExprVectorStream<T, Cont> stream() {return ExprVectorStream<T, Cont>(*this);}
+
+  // 1 byte stores may alias anything, even the pointers inside the expression, which keeps the loop above from
+  // being vectorized. So 1 byte elements are evaluated into a local block, and then copied
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<ev::byte_blocked<T, Cont2>::value && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  inline void assign_elements(const ExprVector<T2, R2>& other)
+  {
+    ev::assign_blocked(cont.data(), other, cont.size());
+  }
+
+  // Small fixed size containers are assigned with a fully unrolled sequence of statements
+  template <typename T2, typename R2, typename Cont2=Cont, typename std::enable_if<(ev::fixed_size<Cont2>::value > 0 && ev::fixed_size<Cont2>::value <= 64) && std::is_same<Cont2,Cont>::value, nullptr_t>::type = nullptr>
+  inline void assign_elements(const ExprVector<T2, R2>& other)
+  {
+    assign_unrolled(other, std::make_index_sequence<ev::fixed_size<Cont>::value>());
+  }
+
+  template <typename T2, typename R2, std::size_t... I>
+  inline void assign_unrolled(const ExprVector<T2, R2>& other, std::index_sequence<I...>)
+  {
+    int expand[] = {0, (cont[I] = other[I], 0)...};
+    (void)expand;
+  }
+
+  // assignment operator for ExprVector of different type
+  template<typename T2=T, typename R2=Cont>
+  ExprVector& operator=(const ExprVector<T2, R2>& other)
+  {
+    if (!try_assign_resized(other))
+      assign_elements(other);
+    return *this;
+  }
+
+  // assignment operator for ExprVector of same type
+  ExprVector& operator=(const ExprVector& other)
+  {
+    if (!try_assign_resized(other))
+      assign_elements(other);
+    return *this;
+  }
+
+  template<typename T2=T, typename R2=Cont, typename std::enable_if<std::is_move_assignable<R2>::value && std::is_same<T2,T>::value && std::is_same<R2,Cont>::value, nullptr_t>::type = nullptr>
+  ExprVector& operator=(ExprVector&& other)
+  {
+    cont = std::move(other.cont);
+    return *this;
+  }
+
+  // Evaluates other in the range [begin, end) only
+  template<typename T2, typename R2>
+  ExprVector& assign_range(const ExprVector<T2, R2>& other, size_t begin, size_t end)
+  {
+    auto&& target = ev::loop_target(cont, begin, end);
+    ev::assign_loop(target, other, begin, end);
+    return *this;
+  }
+
+  // Evaluates other using the executor, worker k computing chunk k (see BuffDataNuma)
+  template<typename T2, typename R2>
+  ExprVector& assign_parallel(const ExprVector<T2, R2>& other)
+  {
+    try_resize_if_needed(other.size());
+    bool streaming = uses_streaming_stores();
+    ExprVectorExecutor::instance().parallel_for(size(), [&](size_t b, size_t e)
+    {
+      if (streaming)
+        assign_streaming(other, b, e);
+      else
+        assign_range(other, b, e);
+    }, ExprVectorExecutor::page_elements<T>());
+    return *this;
+  }
+
+  void operator=(const T& val)
+  {
+    auto&& target = ev::loop_target(cont, 0, cont.size());
+    for (std::size_t i = 0; i < cont.size(); ++i)
+      target[i] = val;
+  }
+
+  ExprVector& operator=(std::initializer_list<T> other)
+  {
+   try_resize_if_needed(other.size());
+   auto&& target = ev::loop_target(cont, 0, cont.size());
+   for (std::size_t i = 0; i < cont.size(); ++i)
+      target[i] = (other.begin())[i];
+    return *this;
+  }
+
+  // size of underlying container
+  inline std::size_t size() const
+  {
+    return cont.size();
+  }
+
+  // index operators
+  inline T operator[](const std::size_t i) const
+  {
+    return cont[i];
+  }
+
+  inline T& operator[](const std::size_t i)
+  {
+    return cont[i];
+  }
+
+  // Negative of ExprVector
+  inline ExprVector<T, ExprVectorNeg<T, Cont> > operator-() {return ExprVector<T, ExprVectorNeg<T, Cont>>(ExprVectorNeg<T, Cont>(contents()));}
+
+#if __GNUC__ < 6 || (__GNUC__ == 6 && __GNUC_MINOR__ <= 1)  // Old compiler
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::initializer_list<long> start_end_step)
+  {
+    using namespace expr_vector_default_index;
+    long start  = start_end_step.begin()[0];
+    long end    = start_end_step.begin()[1];
+    long step   = start_end_step.begin()[2];
+
+    DI x;
+
+    if (start_end_step.size() == 3)
+    {
+      if (start == _ && end == _ && step == _)
+        return operator[](std::make_tuple(x,x,x)); //return [](std::make_tuple<DI,DI,DI>(x,x,x));
+      if (start == _ && end == _ && step != _)
+        return operator[](std::make_tuple(x,x,step)); //return [](std::make_tuple<DI,DI,long>(x,x,step));
+      if (start == _ && end != _ && step == _)
+        return operator[](std::make_tuple(x,end,x)); //return [](std::make_tuple<DI,long,DI>(x,end,x));
+      if (start == _ && end != _ && step != _)
+        return operator[](std::make_tuple(x,end,step)); //return [](std::make_tuple<DI,long,long>(x,end,step));
+
+      if (start != _ && end == _ && step == _)
+        return operator[](std::make_tuple(start,x,x)); //return [](std::make_tuple<long,DI,DI>(start,x,x));
+      if (start != _ && end == _ && step != _)
+        return operator[](std::make_tuple(start,x,step)); //return [](std::make_tuple<long,DI,long>(start,x,step));
+      if (start != _ && end != _ && step == _)
+        return operator[](std::make_tuple(start,end,x));  //return [](std::make_tuple<long,long,DI>(start,end,x));
+      if (start != _ && end != _ && step != _)
+        return operator[](std::make_tuple(start,end,step));  //return [](std::make_tuple<long,long,long>(start,end,step));
+    }
+    else
+    {
+      if (start == _ && end == _)
+        return operator[](std::make_tuple(x,x)); //return [](std::make_tuple<DI,DI>(x,x));
+      if (start == _ && end != _)
+        return operator[](std::make_tuple(x,end)); //return [](std::make_tuple<DI,long>(x,end));
+      if (start != _ && end == _)
+        return operator[](std::make_tuple(start,x)); //return [](std::make_tuple<long,DI>(start,x));
+      if (start != _ && end != _)
+        return operator[](std::make_tuple(start,end));  //return [](std::make_tuple<long,long>(start,end));
+    }
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) ); // This could not be executed
+  }
+#endif  
+
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,DI,DI> start_end_step)
+  {
+    long start = 0;
+    long end = size();
+    long step = 1;
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,DI,long> start_end_step)
+  {
+    long start;
+    long end;
+    long step = std::get<2>(start_end_step);
+
+    if (step > 0)
+    {
+      start = 0;
+      end = size();
+    }
+    else
+    {
+      start = size()-1;
+      end = -1;
+    }
+
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,long,DI> start_end_step)
+  {
+    long start = 0;
+    long end = std::get<1>(start_end_step);
+    long step = 1;
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,long,long> start_end_step)
+  {
+    long start;
+    long end = std::get<1>(start_end_step);
+    long step = std::get<2>(start_end_step);
+
+    if (step > 0)
+      start = 0;
+    else
+      start = size()-1;
+
+    while (end < 0)
+      end += size();
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,DI,DI> start_end_step)
+  {
+    long start = std::get<0>(start_end_step);
+    long end = size();
+    long step = 1;
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,DI,long> start_end_step)
+  {
+    long start  = std::get<0>(start_end_step);
+    long end;
+    long step   = std::get<2>(start_end_step);
+
+    if (step > 0)
+       end = size();
+    else
+      end = -1;
+
+    while (start < 0)
+      start += size();
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,long,DI> start_end_step)
+  {
+    long start  = std::get<0>(start_end_step);
+    long end    = std::get<1>(start_end_step);
+    long step   = 1;
+    while (start < 0)
+      start += size();
+    while (end < 0)
+      end += size();
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }  
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,long,long> start_end_step)
+  {
+    long start  = std::get<0>(start_end_step);
+    long end    = std::get<1>(start_end_step);
+    long step   = std::get<2>(start_end_step);
+    while (start < 0)
+      start += size();
+    while (end < 0)
+      end += size();
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,DI> start_end)
+  {
+    long start  = 0;
+    long end = size();
+    long step = 1;
+
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<DI,long> start_end)
+  {
+    long start  = 0;
+    long end = std::get<1>(start_end);
+    long step = 1;
+
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,DI> start_end)
+  {
+    long start  = std::get<0>(start_end);
+    long end = size();
+    long step = 1;
+
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  // Slice of ExprVector
+  inline ExprVector<T, BuffDataStrided<T, Cont>> operator[](std::tuple<long,long> start_end)
+  {
+    long start  = std::get<0>(start_end);
+    long end    = std::get<1>(start_end);
+    long step   = 1;
+    while (start < 0)
+      start += size();
+    while (end < 0)
+      end += size();
+    return ExprVector<T, BuffDataStrided<T, Cont>>( BuffDataStrided<T, Cont>(contents(), start, end, step) );
+  }
+
+  inline T sum() const
+  {
+    if (size() == 0)
+    {
+      throw std::logic_error("ExprVector::sum() called with zero length buffer");
+    }
+    return ev::sum_loop<T>(cont, size());
+  }
+
+  inline size_t count(const T& val) const
+  {
+    return ev::count_loop(cont, size(), val);
+  }
+
+  // returns the underlying data
+  inline const Cont& contents() const
+  {
+    return cont;
+  }
+
+  inline Cont& contents()
+  {
+    return cont;
+  }
+
+  inline T* data()
+  {
+    return cont.data();
+  }
+
+  inline const T* data() const
+  {
+    return cont.data();
+  }
+
+  inline T* begin()
+  {
+    return cont.data();
+  }
+
+  inline T* end()
+  {
+    return cont.data() + cont.size();
+  }
+
+  std::vector<T> vect() const {return std::vector<T>(ExprVectorIterator<T, Cont>(cont, 0), ExprVectorIterator<T, Cont>(cont, size()));}
+
+  ExprVector<T,BuffDataExt<T>> toExt() {ExprVector<T,BuffDataExt<T>> ret; ret.setBuffer(data(), size()); return ret;}
+
+  static ExprVector zeros(size_t n) {ExprVector v(n,0); return v;}
+
+  // Vector whose element i is fn(i), allocated and filled in one pass
+  template<typename F>
+  static ExprVector generate(size_t n, F fn) {return ExprVector(ExprVector<T, ExprVectorGenerator<T, F>>(ExprVectorGenerator<T, F>(fn, n)));}
+  static ExprVector linspace(T start, T stop, long n) {return generate(n, [=](size_t i) {return start + i * (stop-start)/(n-1);});}
+  //static ExprVector arange(T start, T stop, T step=1) {long n = (stop - start + step - 1) / step; if (n<=0) return ExprVector(0); ExprVector v(n); for (size_t i=0; i<n; i++) v[i] = start + step * i; return v;}
+  static ExprVector arange(T start, T stop, T step=1) {long n = int(ceil((stop - start) / step)); if (n<=0) return ExprVector(0); return generate(n, [=](size_t i) {return start + step * i;});}
+  static ExprVector arange(T stop) {return arange(0, stop, 1);}
+  static ExprVector iota(T start, T stop) {return arange(start, stop);}
+
+  // Keeps the first, minimum, maximum and last points of y inside each of max_points/4 buckets, in index order,
+  // so the shape of the curve (including its peaks) is kept. The buckets are computed in parallel
+  static void decimate_minmax(const ExprVector& x, const ExprVector& y, size_t max_points, std::vector<T>& xo, std::vector<T>& yo)
+  {
+    size_t n = std::min(x.size(), y.size());
+    size_t buckets = std::max<size_t>(1, max_points / 4);
+    if (n <= 4*buckets)
+    {
+      xo.resize(n);
+      yo.resize(n);
+      for (size_t i = 0; i < n; i++)
+      {
+        xo[i] = x[i];
+        yo[i] = y[i];
+      }
+      return;
+    }
+
+    std::vector<size_t> idx(4*buckets);
+    ExprVectorExecutor::instance().parallel_for(n, [&](size_t b, size_t e)
+    {
+      for (size_t k = (b*buckets + n-1) / n; k < buckets && k*n/buckets < e; k++)
+      {
+        size_t first = k*n/buckets, last = (k+1)*n/buckets - 1;
+        size_t imin = first, imax = first;
+        for (size_t i = first+1; i <= last; i++)
+        {
+          if (y[i] < y[imin]) imin = i;
+          if (y[imax] < y[i]) imax = i;
+        }
+        idx[4*k] = first;
+        idx[4*k+1] = std::min(imin, imax);
+        idx[4*k+2] = std::max(imin, imax);
+        idx[4*k+3] = last;
+      }
+    });
+
+    xo.resize(idx.size());
+    yo.resize(idx.size());
+    for (size_t i = 0; i < idx.size(); i++)
+    {
+      xo[i] = x[idx[i]];
+      yo[i] = y[idx[i]];
+    }
+  }
+
+  // Plots using a python interpreter. The (decimated) points are sent in a binary temporary file
+  static bool plot_file(const char* python, const ExprVector& x, const ExprVector& y, size_t max_points = 8000)
+  {
+    std::vector<T> xo, yo;
+    decimate_minmax(x, y, max_points, xo, yo);
+
+    std::vector<double> buf(xo.size() + yo.size());
+    for (size_t i = 0; i < xo.size(); i++)
+    {
+      buf[i] = double(xo[i]);
+      buf[xo.size() + i] = double(yo[i]);
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    char name[] = "/tmp/expr_vector_plot_XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0)
+      return false;
+    bool written = write(fd, buf.data(), buf.size()*sizeof(double)) == ssize_t(buf.size()*sizeof(double));
+    ::close(fd);
+    std::string path = name;
+#else
+    std::string path = std::tmpnam(nullptr);
+    std::ofstream f(path, std::ios::binary);
+    f.write(reinterpret_cast<const char*>(buf.data()), buf.size()*sizeof(double));
+    f.close();
+    bool written = bool(f);
+#endif
+
+    int ret = -1;
+    if (written)
+    {
+      std::stringstream ss;
+      ss << python << " -c \"" << "import numpy as np; import matplotlib.pyplot as plt; d = np.fromfile(r'" << path << "'); n = len(d)//2; plt.plot(d[:n], d[n:]); plt.show()\"";
+      ret = system(ss.str().c_str());
+    }
+    std::remove(path.c_str());
+    return ret == 0;
+  }
+
+  static bool plot_py (const ExprVector& x, const ExprVector& y) {return plot_file("python", x, y);}
+  static bool plot_py2(const ExprVector& x, const ExprVector& y) {return plot_file("python2", x, y);}
+  static bool plot_py3(const ExprVector& x, const ExprVector& y) {return plot_file("python3", x, y);}
+
+  static void plot(const ExprVector& x, const ExprVector& y) { if (!plot_py(x,y) && !plot_py3(x,y) && !plot_py2(x,y)) std::cout << "python+matplotlib+numpy was not found for plotting" << std::endl;}
+  static void plot(const std::vector<T>& x, const std::vector<T>& y) {ExprVector<T, BuffDataExt<T>> xx; ExprVector<T, BuffDataExt<T>> yy; xx.setBuffer(x.data(),x.size()); yy.setBuffer(y.data(),y.size()); plot(xx,yy);}
+};
+
+/** ExprVectorStream is returned by ExprVector::stream(): expressions assigned to it are written with streaming stores */
+template<typename T, typename Cont>
+class ExprVectorStream
+{
+  ExprVector<T, Cont>& v;
+
+public:
+  explicit ExprVectorStream(ExprVector<T, Cont>& v) : v(v) {}
+
+  template<typename T2, typename R2>
+  ExprVector<T, Cont>& operator=(const ExprVector<T2, R2>& other)
+  {
+    v.try_resize_if_needed(other.size());
+    v.assign_streaming(other, 0, v.size());
+    return v;
+  }
+};
+
+// ExprVector with a compile time length, stored inline (ExprVectorFixed<double, 3> for 3-D points)
+template<typename T, std::size_t N>
+using ExprVectorFixed = ExprVector<T, BuffDataFixed<T, N>>;
+
+template <typename T, typename Cont>
+std::ostream& operator<<(std::ostream& os, const ExprVector<T,Cont> & ev)
+{
+  os << "[";
+  if (ev.size() > 0)
+  {
+    os << ev[0];
+    for (size_t i = 1; i < ev.size(); i++)
+      os << ", " << ev[i];
+  }
+  os << "]";
+  return os;
+}
+
+template <typename Cont>
+std::ostream& operator<<(std::ostream& os, const ExprVector<std::string,Cont> & ev)
+{
+  os << "[\"";
+  if (ev.size() > 0)
+  {
+    os << ev[0];
+    for (size_t i = 1; i < ev.size(); i++)
+      os << "\", \"" << ev[i];
+  }
+  os << "\"]";
+  return os;
+}
+
+
+#define ADD_EXPR_VECT_OPERATOR_2_ARGS(NAME, OP)                                   \
+                                                                                  \
+template<typename T, typename Op1, typename Op2>                                  \
+class NAME                                                                        \
+{                                                                                 \
+  const Op1& op1;                                                                 \
+  const Op2& op2;                                                                 \
+                                                                                  \
+public:                                                                           \
+  using type = decltype(op1[0] OP op2[0]);                                        \
+  NAME(const Op1& a, const Op2& b) : op1(a), op2(b) {}                            \
+                                                                                  \
+  inline type operator[](const std::size_t i) const                               \
+  {                                                                               \
+    return op1[i] OP op2[i];                                                      \
+  }                                                                               \
+                                                                                  \
+  const Op1& left() const {return op1;}                                           \
+  const Op2& right() const {return op2;}                                          \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op1.size();                                                            \
+  }                                                                               \
+};                                                                                \
+                                                                                  \
+                                                                                  \
+template<typename T, typename R1, typename R2, typename std::enable_if<!ev::fma_contracts<NAME<T, R1, R2> >::value, nullptr_t>::type = nullptr>   \
+inline ExprVector<typename NAME<T, R1, R2>::type, NAME<T, R1, R2> >               \
+operator OP (const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)              \
+{                                                                                 \
+  return ExprVector<typename NAME<T, R1, R2>::type, NAME<T, R1, R2> >(NAME<T, R1, R2 >(a.contents(), b.contents()));   \
+}                                                                                 \
+
+
+
+#define ADD_EXPR_VECT_PRE_OP(NAME, OP)                                            \
+template<typename T, typename Op2>                                                \
+class NAME                                                                        \
+{                                                                                 \
+  const T val1;                                                                   \
+  const Op2& op2;                                                                 \
+                                                                                  \
+public:                                                                           \
+  NAME(T a, const Op2& b) : val1(a), op2(b) {}                                    \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
+  {                                                                               \
+    return val1 OP op2[i];                                                        \
+  }                                                                               \
+                                                                                  \
+  T left() const {return val1;}                                                   \
+  const Op2& right() const {return op2;}                                          \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op2.size();                                                            \
+  }                                                                               \
+};                                                                                \
+                                                                                  \
+template<typename T, typename R2, typename std::enable_if<!ev::fma_contracts<NAME<T, R2> >::value, nullptr_t>::type = nullptr>   \
+inline ExprVector<T, NAME<T, R2> >                                                \
+operator OP(T a, const ExprVector<T, R2>& b)                                      \
+{                                                                                 \
+  return ExprVector<T, NAME<T, R2> >(NAME<T, R2 >(a, b.contents()));              \
+}                                                                                 \
+
+
+
+#define ADD_EXPR_VECT_POST_OP(NAME, OP)                                           \
+template<typename T, typename Op1>                                                \
+class NAME                                                                        \
+{                                                                                 \
+  const Op1& op1;                                                                 \
+  const T val2;                                                                   \
+                                                                                  \
+public:                                                                           \
+  NAME(const Op1& a, T b) : op1(a), val2(b) {}                                    \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
+  {                                                                               \
+    return op1[i] OP val2;                                                        \
+  }                                                                               \
+                                                                                  \
+  const Op1& left() const {return op1;}                                           \
+  T right() const {return val2;}                                                  \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op1.size();                                                            \
+  }                                                                               \
+};                                                                                \
+                                                                                  \
+template<typename T, typename R1, typename std::enable_if<!ev::fma_contracts<NAME<T, R1> >::value, nullptr_t>::type = nullptr>   \
+inline ExprVector<T, NAME<T, R1> >                                                \
+operator OP(const ExprVector<T, R1>& a, T b)                                      \
+{                                                                                 \
+  return ExprVector<T, NAME<T, R1> >(NAME<T, R1 >(a.contents(), b));              \
+}                                                                                 
+
+
+
+#define ADD_EXPR_VECT_PRE_SCALAR(NAME, OP, TYPE)                                  \
+template<typename T, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>   \
+class NAME                                                                        \
+{                                                                                 \
+  const TYPE val1;                                                                \
+  const Op2& op2;                                                                 \
+                                                                                  \
+public:                                                                           \
+  NAME(TYPE a, const Op2& b) : val1(a), op2(b) {}                                 \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
+  {                                                                               \
+    return val1 OP op2[i];                                                        \
+  }                                                                               \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op2.size();                                                            \
+  }                                                                               \
+};                                                                                \
+                                                                                  \
+template<typename T, typename R2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>    \
+inline ExprVector<T, NAME<T, R2> >                                                \
+operator OP(TYPE a, const ExprVector<T, R2>& b)                                   \
+{                                                                                 \
+  return ExprVector<T, NAME<T, R2> >(NAME<T, R2 >(a, b.contents()));              \
+}                                                                                 \
+
+
+
+#define ADD_EXPR_VECT_POST_SCALAR(NAME, OP, TYPE)                                 \
+template<typename T, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>   \
+class NAME                                                                        \
+{                                                                                 \
+  const Op2& op2;                                                                 \
+  const TYPE val1;                                                                \
+                                                                                  \
+public:                                                                           \
+  NAME(TYPE a, const Op2& b) : val1(a), op2(b) {}                                 \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
+  {                                                                               \
+    return val1 OP op2[i];                                                        \
+  }                                                                               \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op2.size();                                                            \
+  }                                                                               \
+};                                                                                \
+                                                                                  \
+template<typename T, typename R2>                                                 \
+inline ExprVector<T, NAME<T, R2> >                                                \
+operator OP(const ExprVector<T, R2>& b, TYPE a)                                   \
+{                                                                                 \
+  return ExprVector<T, NAME<T, R2> >(NAME<T, R2 >(a, b.contents()));              \
+}                                                                                 \
+                                                                                  \
+
+// This is not too much faster than vectors because of function calls..
+#define ADD_EXPR_VECT_FN_1_ARG(NAME, fn)                                   \
+                                                                           \
+template<typename T, typename Op1>                                         \
+class NAME                                                                 \
+{                                                                          \
+  const Op1& op1;                                                          \
+                                                                           \
+public:                                                                    \
+  using type = decltype(fn(op1[0]));                                       \
+  NAME(const Op1& a) : op1(a) {}                                           \
+                                                                           \
+  inline type operator[](const std::size_t i) const                        \
+  {                                                                        \
+    return fn(op1[i]);                                                     \
+  }                                                                        \
+                                                                           \
+  inline std::size_t size() const                                          \
+  {                                                                        \
+    return op1.size();                                                     \
+  }                                                                        \
+};                                                                         \
+                                                                           \
+                                                                           \
+template<typename T, typename R1>                                          \
+ExprVector<typename NAME<T, R1>::type, NAME<T, R1> >                       \
+inline fn (const ExprVector<T, R1>& a)                                     \
+{                                                                          \
+  return ExprVector<typename NAME<T, R1>::type, NAME<T, R1> >(NAME<T, R1>(a.contents()));      \
+}                                                                          \
+
+
+
+// This is not too much faster than vectors because of function calls..
+#define ADD_EXPR_VECT_FN_2_ARG(NAME, fn)                                          \
+                                                                                  \
+template<typename T, typename Op1, typename Op2>                                  \
+class NAME                                                                        \
+{                                                                                 \
+  const Op1& op1;                                                                 \
+  const Op2& op2;                                                                 \
+                                                                                  \
+public:                                                                           \
+  NAME(const Op1& a, const Op1& b) : op1(a), op2(b) {}                            \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
+  {                                                                               \
+    return fn(op1[i], op2[i]);                                                    \
+  }                                                                               \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op1.size();                                                            \
+  }                                                                               \
+};                                                                                \
+                                                                                  \
+                                                                                  \
+template<typename T, typename R1, typename R2>                                    \
+ExprVector<T, NAME<T, R1, R2> >                                                   \
+inline fn (const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)                \
+{                                                                                 \
+  return ExprVector<T, NAME<T, R1, R2> >(NAME<T, R1, R2>(a.contents(), b.contents()));    \
+}                                                                                 \
+
+
+ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorAdd, +)
+ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorSubtr, -)
+ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorMult, *)
+ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorDiv, /)
+
+ADD_EXPR_VECT_PRE_OP(ExprVectPreSum, +)
+ADD_EXPR_VECT_PRE_OP(ExprVectPreSubtr, -)
+ADD_EXPR_VECT_PRE_OP(ExprVectPreMult, *)
+ADD_EXPR_VECT_PRE_OP(ExprVectPreDiv, /)
+
+ADD_EXPR_VECT_POST_OP(ExprVectPostSum, +)
+ADD_EXPR_VECT_POST_OP(ExprVectPostSubtr, -)
+ADD_EXPR_VECT_POST_OP(ExprVectPostMult, *)
+ADD_EXPR_VECT_POST_OP(ExprVectPostDiv, /)
+
+ADD_EXPR_VECT_PRE_SCALAR(ExprVectPreMultDouble, *, double)
+ADD_EXPR_VECT_POST_SCALAR(ExprVectPostMultDouble, *, double)
+
+ADD_EXPR_VECT_PRE_SCALAR(ExprVectPreMultInt, *, int)
+ADD_EXPR_VECT_POST_SCALAR(ExprVectPostMultInt, *, int)
+
+ADD_EXPR_VECT_POST_SCALAR(ExprVectPostDivDouble, /, double)
+
+ADD_EXPR_VECT_FN_1_ARG(ExprVectorSin, sin)
+ADD_EXPR_VECT_FN_1_ARG(ExprVectorCos, cos)
+ADD_EXPR_VECT_FN_1_ARG(ExprVectorSqrt, sqrt)
+ADD_EXPR_VECT_FN_1_ARG(ExprVectorAbs, abs)
+
+ADD_EXPR_VECT_FN_2_ARG(ExprVectorAtan2, atan2)
+
+
+
+
+#define ADD_EXPR_VECT_PRE_OP_VECT(NAME, OP, TYPE)                                 \
+template<typename T, typename Op1, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>      \
+class NAME                                                                        \
+{                                                                                 \
+  const Op1& op1;                                                                 \
+  const Op2& op2;                                                                 \
+                                                                                  \
+public:                                                                           \
+  NAME(const Op1& a, const Op2& b) : op1(a), op2(b) {}                            \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
   {                                                                               \
-    return val1 OP op2[i];                                                        \
+    return op1[i] OP op2[i];                                                      \
   }                                                                               \
                                                                                   \
   inline std::size_t size() const                                                 \
   {                                                                               \
-    return op2.size();                                                            \
+    return op1.size();                                                            \
   }                                                                               \
 };                                                                                \
                                                                                   \
-template<typename T, typename R2>                                                 \
-inline ExprVector<T, NAME<T, R2> >                                                \
-operator OP(const ExprVector<T, R2>& b, TYPE a)                                   \
+                                                                                  \
+template<typename T, typename R1, typename R2>                                    \
+inline ExprVector<T, NAME<T, R1, R2> >                                            \
+operator OP (const ExprVector<TYPE, R1>& a, const ExprVector<T, R2>& b)           \
 {                                                                                 \
-  return ExprVector<T, NAME<T, R2> >(NAME<T, R2 >(a, b.contents()));              \
+  return ExprVector<T, NAME<T, R1, R2> >(NAME<T, R1, R2 >(a.contents(), b.contents()));   \
 }                                                                                 \
+
+
+
+
+#define ADD_EXPR_VECT_POST_OP_VECT(NAME, OP, TYPE)                                \
+template<typename T, typename Op1, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>       \
+class NAME                                                                        \
+{                                                                                 \
+  const Op1& op1;                                                                 \
+  const Op2& op2;                                                                 \
+                                                                                  \
+public:                                                                           \
+  NAME(const Op1& a, const Op2& b) : op1(a), op2(b) {}                            \
+                                                                                  \
+  inline T operator[](const std::size_t i) const                                  \
+  {                                                                               \
+    return op1[i] OP op2[i];                                                      \
+  }                                                                               \
+                                                                                  \
+  inline std::size_t size() const                                                 \
+  {                                                                               \
+    return op1.size();                                                            \
+  }                                                                               \
+};                                                                                \
                                                                                   \
+                                                                                  \
+template<typename T, typename R1, typename R2>                                    \
+inline ExprVector<T, NAME<T, R1, R2> >                                            \
+operator OP (const ExprVector<T, R1>& a, const ExprVector<TYPE, R2>& b)           \
+{                                                                                 \
+  return ExprVector<T, NAME<T, R1, R2> >(NAME<T, R1, R2 >(a.contents(), b.contents()));   \
+}                                                                                 \
+
+ADD_EXPR_VECT_PRE_OP_VECT(ExprVectPreMultVectDouble, *, double)
+ADD_EXPR_VECT_POST_OP_VECT(ExprVectPostMultVectDouble, *, double)
+ADD_EXPR_VECT_POST_OP_VECT(ExprVectPostMultDivDouble, /, double)
+
+
+// Start of fused multiply-add
+
+/** ExprVectorFma evaluates (+/-)a*b (+/-)c with a single rounding. The sum and difference operators build it
+    instead of a product node under a sum node, as in a*b + c, 2.0*a - b or ((c3*x + c2)*x + c1) */
+template<typename T, typename A, typename B, typename C, bool NegMul, bool NegAdd>
+class ExprVectorFma
+{
+  const A a;
+  const B b;
+  const C c;
+  const std::size_t n;
+
+public:
+  ExprVectorFma(const A& a_, const B& b_, const C& c_, std::size_t n_) : a(a_), b(b_), c(c_), n(n_) {}
+
+  inline T operator[](const std::size_t i) const
+  {
+    T x = a[i];
+    T z = c[i];
+    return std::fma(NegMul ? -x : x, b[i], NegAdd ? -z : z);
+  }
+
+  inline std::size_t size() const
+  {
+    return n;
+  }
+};
+
+namespace ev
+{
+  // Operands of a fused node: a node of the expression, or a scalar
+  template<typename T, typename Op>
+  struct fma_ref
+  {
+    const Op& op;
+    inline T operator[](const std::size_t i) const {return op[i];}
+  };
+
+  template<typename T>
+  struct fma_scalar
+  {
+    T val;
+    inline T operator[](const std::size_t) const {return val;}
+  };
+
+  // Floating point product nodes, giving their factors as operands of a fused node
+  template<typename T, class Node, typename Enable = void>
+  struct fma_product : std::false_type {};
+
+  template<typename T, typename Op1, typename Op2>
+  struct fma_product<T, ExprVectorMult<T, Op1, Op2>, typename std::enable_if<std::is_floating_point<T>::value && EXPR_VECTOR_FMA>::type> : std::true_type
+  {
+    using A = fma_ref<T, Op1>;
+    using B = fma_ref<T, Op2>;
+    static A first(const ExprVectorMult<T, Op1, Op2>& p) {return A{p.left()};}
+    static B second(const ExprVectorMult<T, Op1, Op2>& p) {return B{p.right()};}
+  };
+
+  template<typename T, typename Op2>
+  struct fma_product<T, ExprVectPreMult<T, Op2>, typename std::enable_if<std::is_floating_point<T>::value && EXPR_VECTOR_FMA>::type> : std::true_type
+  {
+    using A = fma_scalar<T>;
+    using B = fma_ref<T, Op2>;
+    static A first(const ExprVectPreMult<T, Op2>& p) {return A{p.left()};}
+    static B second(const ExprVectPreMult<T, Op2>& p) {return B{p.right()};}
+  };
+
+  template<typename T, typename Op1>
+  struct fma_product<T, ExprVectPostMult<T, Op1>, typename std::enable_if<std::is_floating_point<T>::value && EXPR_VECTOR_FMA>::type> : std::true_type
+  {
+    using A = fma_ref<T, Op1>;
+    using B = fma_scalar<T>;
+    static A first(const ExprVectPostMult<T, Op1>& p) {return A{p.left()};}
+    static B second(const ExprVectPostMult<T, Op1>& p) {return B{p.right()};}
+  };
+
+  template<typename T, typename R1, typename R2>
+  struct fma_contracts<ExprVectorAdd<T, R1, R2>> : std::integral_constant<bool, fma_product<T, R1>::value || fma_product<T, R2>::value> {};
+
+  template<typename T, typename R1, typename R2>
+  struct fma_contracts<ExprVectorSubtr<T, R1, R2>> : std::integral_constant<bool, fma_product<T, R1>::value || fma_product<T, R2>::value> {};
+
+  template<typename T, typename R1>
+  struct fma_contracts<ExprVectPostSum<T, R1>> : fma_product<T, R1> {};
+
+  template<typename T, typename R1>
+  struct fma_contracts<ExprVectPostSubtr<T, R1>> : fma_product<T, R1> {};
+
+  template<typename T, typename R2>
+  struct fma_contracts<ExprVectPreSum<T, R2>> : fma_product<T, R2> {};
+
+  template<typename T, typename R2>
+  struct fma_contracts<ExprVectPreSubtr<T, R2>> : fma_product<T, R2> {};
+
+  template<typename T, class P, class C, bool NegMul, bool NegAdd>
+  using fused_t = ExprVector<T, ExprVectorFma<T, typename fma_product<T, P>::A, typename fma_product<T, P>::B, C, NegMul, NegAdd>>;
+
+  // (+/-)p (+/-)c, where p is a product node
+  template<bool NegMul, bool NegAdd, typename T, class P, class C>
+  inline fused_t<T, P, C, NegMul, NegAdd> fused(const P& p, const C& c)
+  {
+    using F = fma_product<T, P>;
+    using Node = ExprVectorFma<T, typename F::A, typename F::B, C, NegMul, NegAdd>;
+    return fused_t<T, P, C, NegMul, NegAdd>(Node(F::first(p), F::second(p), c, p.size()));
+  }
+}
+
+// p + c and c + p
+template<typename T, typename R1, typename R2, typename std::enable_if<ev::fma_product<T, R1>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R1, ev::fma_ref<T, R2>, false, false> operator+(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)
+{
+  return ev::fused<false, false, T>(a.contents(), ev::fma_ref<T, R2>{b.contents()});
+}
+
+template<typename T, typename R1, typename R2, typename std::enable_if<!ev::fma_product<T, R1>::value && ev::fma_product<T, R2>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R2, ev::fma_ref<T, R1>, false, false> operator+(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)
+{
+  return ev::fused<false, false, T>(b.contents(), ev::fma_ref<T, R1>{a.contents()});
+}
+
+// p - c and c - p
+template<typename T, typename R1, typename R2, typename std::enable_if<ev::fma_product<T, R1>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R1, ev::fma_ref<T, R2>, false, true> operator-(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)
+{
+  return ev::fused<false, true, T>(a.contents(), ev::fma_ref<T, R2>{b.contents()});
+}
+
+template<typename T, typename R1, typename R2, typename std::enable_if<!ev::fma_product<T, R1>::value && ev::fma_product<T, R2>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R2, ev::fma_ref<T, R1>, true, false> operator-(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)
+{
+  return ev::fused<true, false, T>(b.contents(), ev::fma_ref<T, R1>{a.contents()});
+}
+
+// p + s, s + p, p - s and s - p
+template<typename T, typename R1, typename std::enable_if<ev::fma_product<T, R1>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R1, ev::fma_scalar<T>, false, false> operator+(const ExprVector<T, R1>& a, T b)
+{
+  return ev::fused<false, false, T>(a.contents(), ev::fma_scalar<T>{b});
+}
+
+template<typename T, typename R2, typename std::enable_if<ev::fma_product<T, R2>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R2, ev::fma_scalar<T>, false, false> operator+(T a, const ExprVector<T, R2>& b)
+{
+  return ev::fused<false, false, T>(b.contents(), ev::fma_scalar<T>{a});
+}
+
+template<typename T, typename R1, typename std::enable_if<ev::fma_product<T, R1>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R1, ev::fma_scalar<T>, false, true> operator-(const ExprVector<T, R1>& a, T b)
+{
+  return ev::fused<false, true, T>(a.contents(), ev::fma_scalar<T>{b});
+}
+
+template<typename T, typename R2, typename std::enable_if<ev::fma_product<T, R2>::value, nullptr_t>::type = nullptr>
+inline ev::fused_t<T, R2, ev::fma_scalar<T>, true, false> operator-(T a, const ExprVector<T, R2>& b)
+{
+  return ev::fused<true, false, T>(b.contents(), ev::fma_scalar<T>{a});
+}
+
+
+
+namespace ev
+{
+  // Memory used by a container, for ordering asynchronous tasks: the elements of a buffer, the whole buffer
+  // under a strided view, or the container object itself
+  template <typename C, typename std::enable_if<is_detected<has_data, C>::value, nullptr_t>::type = nullptr>
+  inline ExprVectorExecutor::Span buffer_span(const C& c)
+  {
+    std::uintptr_t p = reinterpret_cast<std::uintptr_t>(c.data());
+    return ExprVectorExecutor::Span{p, p + c.size() * sizeof(*c.data())};
+  }
+
+  template <typename T, typename Op1>
+  inline ExprVectorExecutor::Span buffer_span(const BuffDataStrided<T, Op1>& c) {return buffer_span(c.op1);}
+
+  template <typename C, typename std::enable_if<!is_detected<has_data, C>::value, nullptr_t>::type = nullptr>
+  inline ExprVectorExecutor::Span buffer_span(const C& c)
+  {
+    std::uintptr_t p = reinterpret_cast<std::uintptr_t>(&c);
+    return ExprVectorExecutor::Span{p, p + sizeof(C)};
+  }
+
+  template <typename T, typename Cont>
+  inline ExprVectorExecutor::Span buffer_id(const ExprVector<T, Cont>& x) {return buffer_span(x.contents());}
+
+  // Runs fn (an assignment or a reduction) on the executor, after previous tasks writing to "reads"
+  // Example: auto s = ev::async_eval([&]{ return (a*b).sum(); }, a, b);
+  template <typename F, typename... Args>
+  inline std::future<decltype(std::declval<F&>()())> async_eval(F fn, const Args&... reads)
+  {
+    return ExprVectorExecutor::instance().submit(std::move(fn), {}, {buffer_id(reads)...});
+  }
+
+  // Runs fn, which assigns to dest, on the executor (dest must already have its final size)
+  // Example: auto f = ev::async_assign(c, [&]{ c = a + 0.5*b; }, a, b);
+  template <typename F, typename T, typename Cont, typename... Args>
+  inline std::future<void> async_assign(ExprVector<T, Cont>& dest, F fn, const Args&... reads)
+  {
+    return ExprVectorExecutor::instance().submit(std::move(fn), {buffer_id(dest)}, {buffer_id(reads)...});
+  }
+}
+
+
+
+/** ExprVectorMap applies a callable to the elements of any number of operands. The callable is stored by
+    value, so it is inlined in the evaluation loop like the built-in operators */
+template<typename T, typename F, typename... Ops>
+class ExprVectorMap
+{
+  F fn;
+  std::tuple<const Ops&...> ops;
+
+  template<std::size_t... I>
+  inline T apply(const std::size_t i, std::index_sequence<I...>) const
+  {
+    return fn(std::get<I>(ops)[i]...);
+  }
+
+public:
+  ExprVectorMap(F f, const Ops&... o) : fn(f), ops(o...) {}
+
+  inline T operator[](const std::size_t i) const
+  {
+    return apply(i, std::index_sequence_for<Ops...>());
+  }
+
+  inline std::size_t size() const
+  {
+    return std::get<0>(ops).size();
+  }
+};
+
+namespace ev
+{
+  template<typename F, typename... Ts>
+  using map_result = typename std::decay<decltype(std::declval<const F&>()(std::declval<Ts>()...))>::type;
+
+  // Lazy element-wise application of fn: ev::map([](double a, double b) {return a > b ? a : b;}, x, y)
+  template<typename F, typename... Ts, typename... Rs>
+  inline ExprVector<map_result<F, Ts...>, ExprVectorMap<map_result<F, Ts...>, F, Rs...>> map(F fn, const ExprVector<Ts, Rs>&... xs)
+  {
+    static_assert(sizeof...(Rs) > 0, "ev::map() needs at least one operand");
+    using R = map_result<F, Ts...>;
+    return ExprVector<R, ExprVectorMap<R, F, Rs...>>(ExprVectorMap<R, F, Rs...>(fn, xs.contents()...));
+  }
+}
+
+
+// Start of saturating integer arithmetic
+
+// The built-in operators promote 8 and 16 bit integers to int (as C++ does). These keep the element type (8, 16 or 32 bit integers), clamping
+// the results to its range. adds, subs and avg of two vectors are written in forms that stay at the lane width of the element type (compilers turn
+// some into packed saturating instructions, as paddusb or pavgb); mul_scaled forms its products in lanes twice as wide
+namespace ev
+{
+  template<typename T>
+  struct wide
+  {
+    static_assert(std::is_integral<T>::value && sizeof(T) <= 4, "Saturating arithmetic is for 8, 16 and 32 bit integers");
+    typedef typename std::conditional<(sizeof(T) == 1 || (sizeof(T) == 2 && std::is_signed<T>::value)), std::int32_t, std::int64_t>::type type;
+  };
+
+  // Type holding any sum or difference of two T
+  template<typename T>
+  using wide_t = typename wide<T>::type;
+
+  // Type holding any product of two T
+  template<typename T>
+  using product_t = typename std::conditional<(std::is_unsigned<T>::value && sizeof(T) == 4), std::uint64_t, wide_t<T>>::type;
+
+  template<typename T, typename W>
+  inline T saturate(W v)
+  {
+    return v < W(std::numeric_limits<T>::min()) ? std::numeric_limits<T>::min() :
+           v > W(std::numeric_limits<T>::max()) ? std::numeric_limits<T>::max() : T(v);
+  }
+
+  // min or max of T, for an overflow in the direction of the sign of a
+  template<typename T>
+  inline T saturated_like(T a) {return T((a >> (sizeof(T)*8 - 1)) ^ std::numeric_limits<T>::max());}
+
+  // Signed: wrapping sum, replaced when a and b have the same sign and the sum has not
+  template<typename T, typename Enable = void>
+  struct adds_fn
+  {
+    typedef typename std::make_unsigned<T>::type U;
+    inline T operator()(T a, T b) const
+    {
+      T s = T(U(a) + U(b));
+      return T((a ^ s) & (b ^ s)) < 0 ? saturated_like(a) : s;
+    }
+  };
+
+  template<typename T>
+  struct adds_fn<T, typename std::enable_if<std::is_unsigned<T>::value>::type>
+  {
+    inline T operator()(T a, T b) const
+    {
+      T s = T(a + b);
+      return T(s | -T(s < a));
+    }
+  };
+
+  template<typename T, typename Enable = void>
+  struct subs_fn
+  {
+    typedef typename std::make_unsigned<T>::type U;
+    inline T operator()(T a, T b) const
+    {
+      T d = T(U(a) - U(b));
+      return T((a ^ b) & (a ^ d)) < 0 ? saturated_like(a) : d;
+    }
+  };
+
+  template<typename T>
+  struct subs_fn<T, typename std::enable_if<std::is_unsigned<T>::value>::type>
+  {
+    inline T operator()(T a, T b) const
+    {
+      T d = T(a - b);
+      return T(d & -T(d <= a));
+    }
+  };
+
+  // Rounding average, (a + b + 1) >> 1, as (a | b) - ((a ^ b) >> 1) which cannot overflow
+  template<typename T, typename Enable = void>
+  struct avg_fn
+  {
+    inline T operator()(T a, T b) const {return T((a | b) - ((a ^ b) >> 1));}
+  };
+
+  // 8 and 16 bit unsigned integers: the form compilers turn into pavgb and pavgw
+  template<typename T>
+  struct avg_fn<T, typename std::enable_if<(std::is_unsigned<T>::value && sizeof(T) < 4)>::type>
+  {
+    inline T operator()(T a, T b) const {return T((wide_t<T>(a) + b + 1) >> 1);}
+  };
+
+  // Rounded (a*b) >> shift, saturated (with shift 15 on int16_t it is the Q15 product, shift 8 on uint8_t scales by b/256)
+  template<typename T>
+  struct mul_scaled_fn
+  {
+    int shift;
+    inline T operator()(T a, T b) const
+    {
+      product_t<T> p = product_t<T>(a) * b;
+      return saturate<T>(shift > 0 ? (p + (product_t<T>(1) << (shift - 1))) >> shift : p);
+    }
+  };
+
+  // a + b for a scalar b in the wide type, so ev::adds(img, 300) and ev::adds(img, -300) saturate
+  template<typename T>
+  struct adds_scalar_fn
+  {
+    wide_t<T> b;
+    inline T operator()(T a) const {return saturate<T>(wide_t<T>(a) + b);}
+  };
+
+  // Binary functor with its second argument fixed
+  template<typename T, typename F>
+  struct bind_scalar
+  {
+    F fn;
+    T b;
+    inline T operator()(T a) const {return fn(a, b);}
+  };
+
+  // Saturating a + b and a - b
+  template<typename T, typename R1, typename R2>
+  inline auto adds(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b) {return map(adds_fn<T>(), a, b);}
+
+  template<typename T, typename R1>
+  inline auto adds(const ExprVector<T, R1>& a, wide_t<T> b) {return map(adds_scalar_fn<T>{b}, a);}
+
+  template<typename T, typename R1, typename R2>
+  inline auto subs(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b) {return map(subs_fn<T>(), a, b);}
+
+  template<typename T, typename R1>
+  inline auto subs(const ExprVector<T, R1>& a, wide_t<T> b) {return map(adds_scalar_fn<T>{-b}, a);}
+
+  // Rounding average of a and b
+  template<typename T, typename R1, typename R2>
+  inline auto avg(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b) {return map(avg_fn<T>(), a, b);}
+
+  template<typename T, typename R1>
+  inline auto avg(const ExprVector<T, R1>& a, wide_t<T> b) {return map(bind_scalar<T, avg_fn<T>>{avg_fn<T>(), saturate<T>(b)}, a);}
+
+  // Saturated, rounded (a*b) >> shift
+  // Example: ev::mul_scaled(img, alpha, 8) scales img by alpha/256 (uint8_t), ev::mul_scaled(x, y, 15) multiplies Q15 values
+  template<typename T, typename R1, typename R2>
+  inline auto mul_scaled(const ExprVector<T, R1>& a, const ExprVector<T, R2>& b, int shift) {return map(mul_scaled_fn<T>{shift}, a, b);}
+
+  template<typename T, typename R1>
+  inline auto mul_scaled(const ExprVector<T, R1>& a, wide_t<T> b, int shift)
+  {
+    return map(bind_scalar<T, mul_scaled_fn<T>>{mul_scaled_fn<T>{shift}, saturate<T>(b)}, a);
+  }
+}
+
+
+// Start of generators: lazy vectors computed from the index, which use no memory
+
+namespace ev
+{
+  template<typename T>
+  struct arange_fn
+  {
+    T start, step;
+    inline T operator()(std::size_t i) const {return start + step * i;}
+  };
+
+  template<typename T>
+  struct linspace_fn
+  {
+    T start, stop;
+    long n;
+    inline T operator()(std::size_t i) const {return start + i * (stop-start)/(n-1);}
+  };
+
+  template<typename T>
+  struct constant_fn
+  {
+    T value;
+    inline T operator()(std::size_t) const {return value;}
+  };
+
+  /** philox4x32 is the counter-based random generator Philox4x32-10 (Salmon et al., 2011).
+      Its output is a pure function of (counter, key), so any element can be computed in parallel and reproduced */
+  struct philox4x32
+  {
+    uint32_t key[2];
+
+    explicit philox4x32(uint64_t seed) : key{uint32_t(seed), uint32_t(seed >> 32)} {}
+
+    inline std::array<uint32_t, 4> operator()(uint64_t counter) const
+    {
+      uint32_t c[4] = {uint32_t(counter), uint32_t(counter >> 32), 0, 0};
+      uint32_t k[2] = {key[0], key[1]};
+      for (int round = 0; round < 10; round++)
+      {
+        uint64_t p0 = uint64_t(0xD2511F53) * c[0];
+        uint64_t p1 = uint64_t(0xCD9E8D57) * c[2];
+        uint32_t next[4] = {uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1), uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0)};
+        c[0] = next[0]; c[1] = next[1]; c[2] = next[2]; c[3] = next[3];
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+      }
+      return {{c[0], c[1], c[2], c[3]}};
+    }
+
+    // Uniform numbers in [0,1) and (0,1], using 53 bits
+    static inline double to_unit(uint32_t hi, uint32_t lo) {return double(((uint64_t(hi) << 32) | lo) >> 11) * (1.0 / 9007199254740992.0);}
+    static inline double to_unit_open(uint32_t hi, uint32_t lo) {return double((((uint64_t(hi) << 32) | lo) >> 11) + 1) * (1.0 / 9007199254740992.0);}
+  };
+
+  template<typename T>
+  struct random_uniform_fn
+  {
+    philox4x32 rng;
+    T low, high;
+    inline T operator()(std::size_t i) const {auto r = rng(i); return T(low + (high - low) * philox4x32::to_unit(r[0], r[1]));}
+  };
+
+  template<typename T>
+  struct random_normal_fn
+  {
+    philox4x32 rng;
+    T mean, stddev;
+    inline T operator()(std::size_t i) const
+    {
+      auto r = rng(i);
+      double radius = std::sqrt(-2.0 * std::log(philox4x32::to_unit_open(r[0], r[1])));
+      return T(mean + stddev * radius * std::cos(6.283185307179586 * philox4x32::to_unit(r[2], r[3])));
+    }
+  };
+
+  template<typename T, typename F>
+  using generated = ExprVector<T, ExprVectorGenerator<T, F>>;
+
+  // Lazy version of ExprVector::arange(): ev::arange(0.0, 40.0, 0.1)
+  template<typename T>
+  inline generated<T, arange_fn<T>> arange(T start, T stop, T step = 1)
+  {
+    long n = long(std::ceil(double(stop - start) / double(step)));
+    return generated<T, arange_fn<T>>(ExprVectorGenerator<T, arange_fn<T>>(arange_fn<T>{start, step}, n > 0 ? n : 0));
+  }
+
+  // Lazy version of ExprVector::linspace()
+  template<typename T>
+  inline generated<T, linspace_fn<T>> linspace(T start, T stop, long n)
+  {
+    return generated<T, linspace_fn<T>>(ExprVectorGenerator<T, linspace_fn<T>>(linspace_fn<T>{start, stop, n}, n));
+  }
+
+  // n copies of value
+  template<typename T>
+  inline generated<T, constant_fn<T>> constant(T value, std::size_t n)
+  {
+    return generated<T, constant_fn<T>>(ExprVectorGenerator<T, constant_fn<T>>(constant_fn<T>{value}, n));
+  }
+
+  template<typename T>
+  inline generated<T, constant_fn<T>> zeros(std::size_t n) {return constant(T(0), n);}
+
+  // n uniform random numbers in [low, high). The same seed always gives the same numbers
+  template<typename T>
+  inline generated<T, random_uniform_fn<T>> random_uniform(std::size_t n, uint64_t seed, T low = 0, T high = 1)
+  {
+    return generated<T, random_uniform_fn<T>>(ExprVectorGenerator<T, random_uniform_fn<T>>(random_uniform_fn<T>{philox4x32(seed), low, high}, n));
+  }
+
+  // n normally distributed random numbers (Box-Muller)
+  template<typename T>
+  inline generated<T, random_normal_fn<T>> random_normal(std::size_t n, uint64_t seed, T mean = 0, T stddev = 1)
+  {
+    return generated<T, random_normal_fn<T>>(ExprVectorGenerator<T, random_normal_fn<T>>(random_normal_fn<T>{philox4x32(seed), mean, stddev}, n));
+  }
+}
+
+
+// Start of interpolation and resampling
+
+/** ExprVectorIndexed computes element i as fn(i, ops...), where fn may read the operands at any position
+    (interpolation, resampling and lookups). As in ExprVectorMap, fn is stored by value and inlined */
+template<typename T, typename F, typename... Ops>
+class ExprVectorIndexed
+{
+  F fn;
+  std::tuple<const Ops&...> ops;
+  std::size_t n;
+
+  template<std::size_t... I>
+  inline T apply(const std::size_t i, std::index_sequence<I...>) const
+  {
+    return fn(i, std::get<I>(ops)...);
+  }
+
+public:
+  ExprVectorIndexed(F f, std::size_t n, const Ops&... o) : fn(f), ops(o...), n(n) {}
+
+  inline T operator[](const std::size_t i) const
+  {
+    return apply(i, std::index_sequence_for<Ops...>());
+  }
+
+  inline std::size_t size() const
+  {
+    return n;
+  }
+};
+
+namespace ev
+{
+  template<typename T, typename F, typename... Rs>
+  using indexed = ExprVector<T, ExprVectorIndexed<T, F, Rs...>>;
+
+  // Linear interpolation over increasing points xp. The segment search starts at the segment found by the previous
+  // call on the same node, so monotonic queries cost amortized O(1) instead of a binary search each
+  template<typename T>
+  struct interp_fn
+  {
+    search_hint hint;
+
+    template<typename Q, typename XP, typename FP>
+    inline T operator()(std::size_t i, const Q& xq, const XP& xp, const FP& fp) const
+    {
+      const std::size_t m = xp.size();
+      T x = xq[i];
+      if (x != x)
+        return x;
+      if (x <= xp[0])
+        return fp[0];
+      if (x >= xp[m-1])
+        return fp[m-1];
+
+      // Segment k with xp[k] <= x < xp[k+1]
+      search_hint::position& h = hint.local();
+      std::size_t k = std::min(h.get(), m - 2);
+      if (xp[k] > x)
+        k = std::upper_bound(ExprVectorIterator<T, XP>(xp, 0), ExprVectorIterator<T, XP>(xp, k), x) - ExprVectorIterator<T, XP>(xp, 0) - 1;
+      else
+      {
+        std::size_t steps = 0;
+        while (xp[k+1] <= x && ++steps < 8)
+          k++;
+        if (xp[k+1] <= x)
+          k = std::upper_bound(ExprVectorIterator<T, XP>(xp, k + 1), ExprVectorIterator<T, XP>(xp, m), x) - ExprVectorIterator<T, XP>(xp, 0) - 1;
+      }
+      h.set(k);
+      T w = (x - xp[k]) / (xp[k+1] - xp[k]);
+      return fp[k] + w * (fp[k+1] - fp[k]);
+    }
+  };
+
+  // Linear interpolation over the uniform grid x0 + k/inv_dx, k in [0, last]. The segment is computed, so the
+  // loop has no search and no branches (the reads of fp are a gather)
+  template<typename T>
+  struct interp_uniform_fn
+  {
+    T x0, inv_dx;
+    std::size_t last;
+
+    template<typename Q, typename FP>
+    inline T operator()(std::size_t i, const Q& xq, const FP& fp) const
+    {
+      T x = xq[i];
+      if (x != x)
+        return x;
+      T t = (x - x0) * inv_dx;
+      t = t >= T(0) ? (t < T(last) ? t : T(last)) : T(0);
+      std::size_t k = std::min(std::size_t(t), last - 1);
+      T w = t - T(k);
+      return fp[k] + w * (fp[k+1] - fp[k]);
+    }
+  };
+
+  // Integer ratio: L-1 linearly interpolated samples between each two samples of x
+  template<typename T>
+  struct upsample_fn
+  {
+    std::size_t L;
+    T inv_L;
+
+    template<typename X>
+    inline T operator()(std::size_t i, const X& x) const
+    {
+      std::size_t k = i / L, r = i % L;
+      return r == 0 ? x[k] : x[k] + (T(r) * inv_L) * (x[k+1] - x[k]);
+    }
+  };
+
+  // Integer ratio: mean of each M consecutive samples of x (a box filter against aliasing)
+  template<typename T>
+  struct downsample_fn
+  {
+    std::size_t M;
+
+    template<typename X>
+    inline T operator()(std::size_t i, const X& x) const
+    {
+      T s = x[i*M];
+      for (std::size_t j = 1; j < M; j++)
+        s = s + x[i*M + j];
+      return s / T(M);
+    }
+  };
+
+  // Any ratio: x linearly interpolated at the position i*scale (between 0 and last)
+  template<typename T>
+  struct resample_fn
+  {
+    T scale;
+    std::size_t last;
+
+    template<typename X>
+    inline T operator()(std::size_t i, const X& x) const
+    {
+      T p = T(i) * scale;
+      std::size_t k = std::min(std::size_t(p), last - 1);
+      T w = p - T(k);
+      return x[k] + w * (x[k+1] - x[k]);
+    }
+  };
+
+  // table[idx[i]], with the index clamped to the table
+  template<typename T>
+  struct lookup_fn
+  {
+    template<typename I, typename Tab>
+    inline T operator()(std::size_t i, const I& idx, const Tab& table) const
+    {
+      auto k = idx[i];
+      std::size_t last = table.size() - 1;
+      std::size_t j = k > decltype(k)(0) ? std::min(std::size_t(k), last) : 0;
+      return table[j];
+    }
+  };
+
+  template<typename T, typename Cont>
+  inline void check_points(const ExprVector<T, Cont>& x, std::size_t min_points, const char* fn)
+  {
+    static_assert(std::is_floating_point<T>::value, "interpolation needs floating point values");
+    if (x.size() < min_points)
+      throw ExprVectorException((std::string(fn) + ": not enough points").c_str());
+  }
+
+  // Linear interpolation of the points (xp, fp) at xq, as numpy.interp (queries outside xp take the end values)
+  // Example: y2 = 2.0 * ev::interp(t2, t, y);
+  template<typename T, typename RQ, typename RX, typename RF>
+  inline indexed<T, interp_fn<T>, RQ, RX, RF> interp(const ExprVector<T, RQ>& xq, const ExprVector<T, RX>& xp, const ExprVector<T, RF>& fp)
+  {
+    check_points(xp, 2, "interp()");
+    if (fp.size() != xp.size())
+      throw ExprVectorException("interp(): xp and fp have different sizes");
+    return indexed<T, interp_fn<T>, RQ, RX, RF>(ExprVectorIndexed<T, interp_fn<T>, RQ, RX, RF>(interp_fn<T>(), xq.size(), xq.contents(), xp.contents(), fp.contents()));
+  }
+
+  // Interpolation over the uniform grid x0 + k*dx, k in [0, fp.size())
+  template<typename T, typename RQ, typename RF>
+  inline indexed<T, interp_uniform_fn<T>, RQ, RF> interp(const ExprVector<T, RQ>& xq, T x0, T dx, const ExprVector<T, RF>& fp)
+  {
+    check_points(fp, 2, "interp()");
+    interp_uniform_fn<T> fn{x0, T(1) / dx, fp.size() - 1};
+    return indexed<T, interp_uniform_fn<T>, RQ, RF>(ExprVectorIndexed<T, interp_uniform_fn<T>, RQ, RF>(fn, xq.size(), xq.contents(), fp.contents()));
+  }
+
+  // Grids made by ev::arange() and ev::linspace() are known to be uniform
+  template<typename T, typename RQ, typename RF>
+  inline indexed<T, interp_uniform_fn<T>, RQ, RF> interp(const ExprVector<T, RQ>& xq, const generated<T, arange_fn<T>>& xp, const ExprVector<T, RF>& fp)
+  {
+    if (fp.size() != xp.size())
+      throw ExprVectorException("interp(): xp and fp have different sizes");
+    return interp(xq, xp.contents().function().start, xp.contents().function().step, fp);
+  }
+
+  template<typename T, typename RQ, typename RF>
+  inline indexed<T, interp_uniform_fn<T>, RQ, RF> interp(const ExprVector<T, RQ>& xq, const generated<T, linspace_fn<T>>& xp, const ExprVector<T, RF>& fp)
+  {
+    if (fp.size() != xp.size())
+      throw ExprVectorException("interp(): xp and fp have different sizes");
+    const linspace_fn<T>& f = xp.contents().function();
+    return interp(xq, f.start, (f.stop - f.start) / T(f.n - 1), fp);
+  }
+
+  // Resampling by an integer ratio: upsample() gives (n-1)*L + 1 samples, downsample() gives n/M samples
+  template<typename T, typename R>
+  inline indexed<T, upsample_fn<T>, R> upsample(const ExprVector<T, R>& x, std::size_t L)
+  {
+    check_points(x, 1, "upsample()");
+    if (L == 0)
+      throw ExprVectorException("upsample(): the ratio must be positive");
+    return indexed<T, upsample_fn<T>, R>(ExprVectorIndexed<T, upsample_fn<T>, R>(upsample_fn<T>{L, T(1) / T(L)}, (x.size() - 1) * L + 1, x.contents()));
+  }
+
+  template<typename T, typename R>
+  inline indexed<T, downsample_fn<T>, R> downsample(const ExprVector<T, R>& x, std::size_t M)
+  {
+    if (M == 0)
+      throw ExprVectorException("downsample(): the ratio must be positive");
+    return indexed<T, downsample_fn<T>, R>(ExprVectorIndexed<T, downsample_fn<T>, R>(downsample_fn<T>{M}, x.size() / M, x.contents()));
+  }
+
+  // Resampling to any number of samples, linearly interpolated (the first and last samples are kept)
+  template<typename T, typename R>
+  inline indexed<T, resample_fn<T>, R> resample(const ExprVector<T, R>& x, std::size_t n)
+  {
+    check_points(x, 2, "resample()");
+    T scale = n > 1 ? T(x.size() - 1) / T(n - 1) : T(0);
+    return indexed<T, resample_fn<T>, R>(ExprVectorIndexed<T, resample_fn<T>, R>(resample_fn<T>{scale, x.size() - 1}, n, x.contents()));
+  }
+
+  // Table lookup: element i is table[idx[i]] (indices outside the table are clamped)
+  template<typename TI, typename RI, typename T, typename RT>
+  inline indexed<T, lookup_fn<T>, RI, RT> lookup(const ExprVector<TI, RI>& idx, const ExprVector<T, RT>& table)
+  {
+    if (table.size() == 0)
+      throw ExprVectorException("lookup(): empty table");
+    return indexed<T, lookup_fn<T>, RI, RT>(ExprVectorIndexed<T, lookup_fn<T>, RI, RT>(lookup_fn<T>(), idx.size(), idx.contents(), table.contents()));
+  }
+}
+
+
+// Start of histograms
+
+namespace ev
+{
+  // Runs count(b, e, bins) over chunks of [0,n) in parallel, each chunk with private bins, and adds them up
+  template<typename F>
+  inline std::vector<size_t> privatized_counts(size_t n, size_t nbins, F count)
+  {
+    std::vector<size_t> total(nbins, 0);
+    std::mutex m;
+    ExprVectorExecutor::instance().parallel_for(n, [&](size_t b, size_t e)
+    {
+      std::vector<size_t> bins(nbins, 0);
+      count(b, e, bins);
+      std::lock_guard<std::mutex> lock(m);
+      for (size_t k = 0; k < nbins; k++)
+        total[k] += bins[k];
+    });
+    return total;
+  }
+
+  // Bin of x for nbins bins of the same width starting at low, found with a multiplication (nbins if x is outside)
+  inline size_t uniform_bin(double x, double low, double high, double scale, size_t nbins)
+  {
+    if (!(x >= low && x <= high))
+      return nbins;
+    size_t k = size_t((x - low) * scale);
+    return k < nbins ? k : nbins - 1;
+  }
+
+  // Counts the elements of x inside each of nbins bins of the same width over [low, high] (the last bin
+  // includes high, as numpy.histogram). The expression is evaluated on the fly
+  template<typename T, typename Cont>
+  std::vector<size_t> histogram(const ExprVector<T, Cont>& x, size_t nbins, double low, double high)
+  {
+    if (nbins == 0 || !(high > low))
+      throw ExprVectorException("histogram() needs nbins > 0 and high > low");
+    const double scale = nbins / (high - low);
+
+    std::vector<size_t> counts = privatized_counts(x.size(), nbins + 1, [&](size_t b, size_t e, std::vector<size_t>& bins)
+    {
+      // Four sets of bins (one per lane) avoid serializing the increments of repeated bins
+      std::vector<size_t> lanes(4 * (nbins + 1), 0);
+      size_t* l0 = &lanes[0];
+      size_t* l1 = l0 + (nbins + 1);
+      size_t* l2 = l1 + (nbins + 1);
+      size_t* l3 = l2 + (nbins + 1);
+      size_t i = b;
+      for (; i + 4 <= e; i += 4)
+      {
+        l0[uniform_bin(double(x[i]), low, high, scale, nbins)]++;
+        l1[uniform_bin(double(x[i+1]), low, high, scale, nbins)]++;
+        l2[uniform_bin(double(x[i+2]), low, high, scale, nbins)]++;
+        l3[uniform_bin(double(x[i+3]), low, high, scale, nbins)]++;
+      }
+      for (; i < e; i++)
+        l0[uniform_bin(double(x[i]), low, high, scale, nbins)]++;
+      for (size_t k = 0; k <= nbins; k++)
+        bins[k] = l0[k] + l1[k] + l2[k] + l3[k];
+    });
+    counts.pop_back();   // elements outside of the range
+    return counts;
+  }
+
+  // Counts the elements of x between consecutive sorted edges (the last bin includes edges.back()).
+  // The bin is guessed with a multiplication, as if widths were uniform, and then corrected, so uniform
+  // edges need no binary search
+  template<typename T, typename Cont, typename E>
+  std::vector<size_t> histogram(const ExprVector<T, Cont>& x, const std::vector<E>& edges)
+  {
+    if (edges.size() < 2)
+      throw ExprVectorException("histogram() needs at least two edges");
+    const size_t nbins = edges.size() - 1;
+    const double low = double(edges.front()), high = double(edges.back());
+    const double scale = nbins / (high - low);
+
+    std::vector<size_t> counts = privatized_counts(x.size(), nbins + 1, [&](size_t b, size_t e, std::vector<size_t>& bins)
+    {
+      for (size_t i = b; i < e; i++)
+      {
+        double v = double(x[i]);
+        size_t k = uniform_bin(v, low, high, scale, nbins);
+        if (k < nbins)
+        {
+          if (v < edges[k] || (k + 1 < nbins && v >= edges[k+1]))
+            k = std::min<size_t>(std::upper_bound(edges.begin(), edges.end(), v) - edges.begin() - 1, nbins - 1);
+        }
+        bins[k]++;
+      }
+    });
+    counts.pop_back();
+    return counts;
+  }
+
+  // Number of occurrences of each value of x, which must be a non negative integer (as numpy.bincount)
+  template<typename T, typename Cont>
+  std::vector<size_t> bincount(const ExprVector<T, Cont>& x, size_t minlength = 0)
+  {
+    static_assert(std::is_integral<T>::value, "bincount() needs an integer expression");
+    std::vector<size_t> total(minlength, 0);
+    std::mutex m;
+    bool negative = false;
+    ExprVectorExecutor::instance().parallel_for(x.size(), [&](size_t b, size_t e)
+    {
+      std::vector<size_t> bins(minlength, 0);
+      bool neg = false;
+      for (size_t i = b; i < e; i++)
+      {
+        T v = x[i];
+        if (v < 0)
+        {
+          neg = true;
+          continue;
+        }
+        if (size_t(v) >= bins.size())
+          bins.resize(size_t(v) + 1, 0);
+        bins[size_t(v)]++;
+      }
+      std::lock_guard<std::mutex> lock(m);
+      negative = negative || neg;
+      if (bins.size() > total.size())
+        total.resize(bins.size(), 0);
+      for (size_t k = 0; k < bins.size(); k++)
+        total[k] += bins[k];
+    });
+    if (negative)
+      throw ExprVectorException("bincount() called with negative values");
+    return total;
+  }
+}
+
+
+// Start of grouped reductions
+
+namespace ev
+{
+  // Sum, count, minimum and maximum of the values of a group
+  template<typename T>
+  struct group_aggregate
+  {
+    T sum, min, max;
+    std::size_t count;
+
+    explicit group_aggregate(T v) : sum(v), min(v), max(v), count(1) {}
+
+    inline void add(T v)
+    {
+      sum += v;
+      min = v < min ? v : min;
+      max = max < v ? v : max;
+      count++;
+    }
+
+    inline void merge(const group_aggregate& other)
+    {
+      sum += other.sum;
+      min = other.min < min ? other.min : min;
+      max = max < other.max ? other.max : max;
+      count += other.count;
+    }
+  };
+}
+
+/** ExprVectorGroups holds the sum, count, minimum and maximum of the values of each key, as returned by
+    ev::reduce_by_key() and ev::group_by(). The results are vectors, so they can be used in expressions */
+template<typename K, typename T>
+class ExprVectorGroups
+{
+public:
+  ExprVector<K> keys;
+  ExprVector<T> sum, min, max;
+  ExprVector<std::size_t> count;
+
+  ExprVectorGroups() {}
+
+  ExprVectorGroups(const std::vector<K>& k, const std::vector<ev::group_aggregate<T>>& aggs) : keys(k.size()), sum(k.size()), min(k.size()), max(k.size()), count(k.size())
+  {
+    for (std::size_t g = 0; g < k.size(); g++)
+    {
+      keys[g] = k[g];
+      sum[g] = aggs[g].sum;
+      min[g] = aggs[g].min;
+      max[g] = aggs[g].max;
+      count[g] = aggs[g].count;
+    }
+  }
+
+  // Number of groups
+  std::size_t size() const {return keys.size();}
+
+  ExprVector<T> mean() const
+  {
+    return ExprVector<T>(sum / ExprVector<T>(count));
+  }
+};
+
+namespace ev
+{
+  // Aggregates the values of each run of equal consecutive keys (as thrust::reduce_by_key), so sorted keys give
+  // one group per key. Each chunk is reduced in a single streaming pass, and the runs which cross the border
+  // between two chunks are merged. Both keys and values can be expressions
+  template<typename K, typename RK, typename T, typename RV>
+  ExprVectorGroups<K, T> reduce_by_key(const ExprVector<K, RK>& keys, const ExprVector<T, RV>& values)
+  {
+    if (keys.size() != values.size())
+      throw ExprVectorException("reduce_by_key(): keys and values have different sizes");
+
+    using runs = std::pair<std::vector<K>, std::vector<group_aggregate<T>>>;
+    std::map<std::size_t, runs> parts;   // by the start of the chunk
+    std::mutex m;
+    ExprVectorExecutor::instance().parallel_for(keys.size(), [&](std::size_t b, std::size_t e)
+    {
+      if (b >= e)
+        return;
+      runs r;
+      K key = keys[b];
+      group_aggregate<T> agg(values[b]);
+      for (std::size_t i = b + 1; i < e; i++)
+      {
+        K k = keys[i];
+        T v = values[i];
+        if (k == key)
+          agg.add(v);
+        else
+        {
+          r.first.push_back(key);
+          r.second.push_back(agg);
+          key = k;
+          agg = group_aggregate<T>(v);
+        }
+      }
+      r.first.push_back(key);
+      r.second.push_back(agg);
+      std::lock_guard<std::mutex> lock(m);
+      parts[b] = std::move(r);
+    });
+
+    std::vector<K> out_keys;
+    std::vector<group_aggregate<T>> out;
+    for (auto& part : parts)
+    {
+      std::size_t j = 0;
+      if (!out.empty() && out_keys.back() == part.second.first[0])
+        out.back().merge(part.second.second[j++]);
+      out_keys.insert(out_keys.end(), part.second.first.begin() + j, part.second.first.end());
+      out.insert(out.end(), part.second.second.begin() + j, part.second.second.end());
+    }
+    return ExprVectorGroups<K, T>(out_keys, out);
+  }
+
+  // Aggregates the values of each key, for keys in any order. Each chunk fills a private hash table, and the
+  // tables are merged in chunk order, so the groups are in order of first appearance. Repeated keys skip the
+  // hash lookup, which makes bursts of the same key cheap
+  template<typename K, typename RK, typename T, typename RV, typename Hash = std::hash<K>>
+  ExprVectorGroups<K, T> group_by(const ExprVector<K, RK>& keys, const ExprVector<T, RV>& values)
+  {
+    if (keys.size() != values.size())
+      throw ExprVectorException("group_by(): keys and values have different sizes");
+
+    struct table
+    {
+      std::unordered_map<K, std::size_t, Hash> index;
+      std::vector<K> keys;
+      std::vector<group_aggregate<T>> aggs;
+
+      // Index of the group of k, which is created (with the aggregate a) if it didn't exist
+      inline std::size_t find_or_add(const K& k, const group_aggregate<T>& a, bool& added)
+      {
+        auto it = index.emplace(k, keys.size());
+        added = it.second;
+        if (added)
+        {
+          keys.push_back(k);
+          aggs.push_back(a);
+        }
+        return it.first->second;
+      }
+    };
+
+    std::map<std::size_t, table> parts;
+    std::mutex m;
+    ExprVectorExecutor::instance().parallel_for(keys.size(), [&](std::size_t b, std::size_t e)
+    {
+      if (b >= e)
+        return;
+      table t;
+      bool added;
+      K last = keys[b];
+      std::size_t g = t.find_or_add(last, group_aggregate<T>(values[b]), added);
+      for (std::size_t i = b + 1; i < e; i++)
+      {
+        K k = keys[i];
+        T v = values[i];
+        if (!(k == last))
+        {
+          last = k;
+          g = t.find_or_add(k, group_aggregate<T>(v), added);
+          if (added)
+            continue;
+        }
+        t.aggs[g].add(v);
+      }
+      std::lock_guard<std::mutex> lock(m);
+      parts[b] = std::move(t);
+    });
+
+    if (parts.empty())
+      return ExprVectorGroups<K, T>();
+    table& total = parts.begin()->second;
+    for (auto it = std::next(parts.begin()); it != parts.end(); ++it)
+    {
+      bool added;
+      for (std::size_t j = 0; j < it->second.keys.size(); j++)
+      {
+        std::size_t g = total.find_or_add(it->second.keys[j], it->second.aggs[j], added);
+        if (!added)
+          total.aggs[g].merge(it->second.aggs[j]);
+      }
+    }
+    return ExprVectorGroups<K, T>(total.keys, total.aggs);
+  }
+}
+
+
+// Start of searches: reductions which stop as soon as the answer is known
+
+namespace ev
+{
+  // Index returned by the searches when nothing is found
+  constexpr size_t npos = size_t(-1);
+
+  constexpr size_t search_block = 1024;
+
+  // First i in [b, e) with pred(x[i]), or e. Each block is first tested without branches (pred results or'ed,
+  // which vectorizes), and only a block with a match is scanned for its position. The search stops before
+  // a block starting at or after "stop" (which other workers may lower)
+  template<typename T, typename Cont, typename P>
+  inline size_t find_in(const ExprVector<T, Cont>& x, const P& pred, size_t b, size_t e, const std::atomic<size_t>& stop)
+  {
+    for (size_t start = b; start < e; start += search_block)
+    {
+      if (start >= stop.load(std::memory_order_relaxed))
+        return e;
+      size_t end = std::min(start + search_block, e);
+      bool hit = false;
+      for (size_t i = start; i < end; i++)
+        hit |= bool(pred(x[i]));
+      if (hit)
+        for (size_t i = start; i < end; i++)
+          if (pred(x[i]))
+            return i;
+    }
+    return e;
+  }
+
+  // Index of the first element of x with pred(element) true, or ev::npos. Chunks are searched in parallel,
+  // and a match cancels the chunks after it
+  // Example: size_t i = ev::find_first(a - b, [](double v) {return std::isnan(v) || v > 10.0;});
+  template<typename T, typename Cont, typename P>
+  size_t find_first(const ExprVector<T, Cont>& x, P pred)
+  {
+    std::atomic<size_t> best(npos);
+    ExprVectorExecutor::instance().parallel_for(x.size(), [&](size_t b, size_t e)
+    {
+      size_t i = find_in(x, pred, b, e, best);
+      if (i == e)
+        return;
+      size_t cur = best.load();
+      while (i < cur && !best.compare_exchange_weak(cur, i)) {}
+    }, search_block);
+    return best.load();
+  }
+
+  // True if pred is true for some element (the first match found cancels every chunk)
+  template<typename T, typename Cont, typename P>
+  bool any(const ExprVector<T, Cont>& x, P pred)
+  {
+    std::atomic<size_t> stop(npos);
+    ExprVectorExecutor::instance().parallel_for(x.size(), [&](size_t b, size_t e)
+    {
+      if (find_in(x, pred, b, e, stop) != e)
+        stop.store(0);
+    }, search_block);
+    return stop.load() == 0;
+  }
+
+  // True if pred is true for every element
+  template<typename T, typename Cont, typename P>
+  bool all(const ExprVector<T, Cont>& x, P pred)
+  {
+    return !any(x, [&](const T& v) {return !pred(v);});
+  }
+
+  // Elements converted to bool, as any(a > b) in numpy: ev::any(ev::map(...)) or ev::any(a - b)
+  template<typename T, typename Cont>
+  bool any(const ExprVector<T, Cont>& x) {return any(x, [](const T& v) {return bool(v);});}
+
+  template<typename T, typename Cont>
+  bool all(const ExprVector<T, Cont>& x) {return all(x, [](const T& v) {return bool(v);});}
+
+  // Position of the first best element by "better" (NaN are skipped). Each block finds its best value without
+  // branches, and is only scanned for the position when it improves the current best
+  template<typename T, typename Cont, typename Better>
+  size_t arg_best(const ExprVector<T, Cont>& x, Better better)
+  {
+    if (x.size() == 0)
+      throw ExprVectorException("argmin()/argmax() called with zero length vector");
+    std::mutex m;
+    size_t best = npos;
+    T best_val = T();
+    ExprVectorExecutor::instance().parallel_for(x.size(), [&](size_t b, size_t e)
+    {
+      size_t pos = npos;
+      T val = T();
+      for (size_t start = b; start < e; start += search_block)
+      {
+        size_t end = std::min(start + search_block, e);
+        T blk = x[start];
+        for (size_t i = start + 1; i < end; i++)
+        {
+          T v = x[i];
+          blk = better(v, blk) || blk != blk ? v : blk;
+        }
+        if (blk == blk && (pos == npos || better(blk, val)))
+        {
+          val = blk;
+          for (pos = start; !(x[pos] == blk); pos++) {}
+        }
+      }
+      std::lock_guard<std::mutex> lock(m);
+      if (pos != npos && (best == npos || better(val, best_val) || (!better(best_val, val) && pos < best)))
+      {
+        best = pos;
+        best_val = val;
+      }
+    }, search_block);
+    return best;
+  }
+
+  // Index of the first minimum (or maximum) element, ignoring NaN (ev::npos if every element is NaN)
+  template<typename T, typename Cont>
+  size_t argmin(const ExprVector<T, Cont>& x) {return arg_best(x, [](const T& a, const T& b) {return a < b;});}
+
+  template<typename T, typename Cont>
+  size_t argmax(const ExprVector<T, Cont>& x) {return arg_best(x, [](const T& a, const T& b) {return a > b;});}
+}
+
+
+// Start of runtime formulas
+
+/** ExprVectorFormula evaluates a formula given as text, as "a + 0.5*sin(b)/c", over named buffers.
+    The formula is compiled to a register bytecode, which is interpreted over blocks of elements small
+    enough to stay in cache. Every instruction is a simple loop over a block, and blocks run in parallel */
+template<typename T>
+class ExprVectorFormula
+{
+public:
+  // Buffer of a variable: an ExprVector with memory, or a pointer and a number of elements
+  struct Input
+  {
+    const T* data;
+    std::size_t size;
+
+    Input(const T* data, std::size_t size) : data(data), size(size) {}
+
+    template<typename Cont>
+    Input(const ExprVector<T, Cont>& x) : data(x.data()), size(x.size()) {}
+  };
+
+  using Inputs = std::map<std::string, Input>;
+
+  static constexpr std::size_t block_size = 512;
+
+  // Compiled formulas kept by compile(); the cache is emptied when it is full
+  static constexpr std::size_t max_cached = 256;
+
+private:
+  enum class Op {Copy, Neg, Add, Sub, Mul, Div, Pow, Atan2, Sin, Cos, Tan, Sqrt, Abs, Exp, Log};
+  enum class Kind {Reg, Var, Const};
+
+  struct Operand
+  {
+    Kind kind;
+    std::size_t idx;
+  };
+
+  struct Instr
+  {
+    Op op;
+    std::size_t dst;
+    Operand a, b;
+  };
+
+  std::string text_;
+  std::vector<std::string> vars_;
+  std::vector<T> consts_;
+  std::vector<Instr> code_;
+  std::size_t nregs_ = 0;     // the last register is the output buffer
+
+  // Parser state, used only while compiling
+  std::size_t pos_ = 0;
+  std::vector<std::size_t> free_regs_;
+
+  void error(const std::string& msg) const
+  {
+    throw ExprVectorException(("ExprVectorFormula: " + msg + " at position " + std::to_string(pos_) + " of \"" + text_ + "\"").c_str());
+  }
+
+  void skip_spaces() {while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) pos_++;}
+
+  bool accept(const char* token)
+  {
+    skip_spaces();
+    std::size_t len = std::char_traits<char>::length(token);
+    if (text_.compare(pos_, len, token) != 0)
+      return false;
+    pos_ += len;
+    return true;
+  }
+
+  void expect(const char* token) {if (!accept(token)) error(std::string("expected '") + token + "'");}
+
+  Operand constant(T value)
+  {
+    consts_.push_back(value);
+    return Operand{Kind::Const, consts_.size() - 1};
+  }
+
+  void release(const Operand& x) {if (x.kind == Kind::Reg) free_regs_.push_back(x.idx);}
+
+  std::size_t new_reg()
+  {
+    if (!free_regs_.empty())
+    {
+      std::size_t r = free_regs_.back();
+      free_regs_.pop_back();
+      return r;
+    }
+    return nregs_++;
+  }
+
+  static bool is_unary(Op op) {return op == Op::Copy || op == Op::Neg || op >= Op::Sin;}
+
+  // Runs op over len elements. Each case is a plain loop, which the compiler can vectorize
+  static void run(Op op, T* d, const T* a, const T* b, std::size_t len)
+  {
+    switch (op)
+    {
+      case Op::Copy:  for (std::size_t j = 0; j < len; j++) d[j] = a[j]; break;
+      case Op::Neg:   for (std::size_t j = 0; j < len; j++) d[j] = -a[j]; break;
+      case Op::Add:   for (std::size_t j = 0; j < len; j++) d[j] = a[j] + b[j]; break;
+      case Op::Sub:   for (std::size_t j = 0; j < len; j++) d[j] = a[j] - b[j]; break;
+      case Op::Mul:   for (std::size_t j = 0; j < len; j++) d[j] = a[j] * b[j]; break;
+      case Op::Div:   for (std::size_t j = 0; j < len; j++) d[j] = a[j] / b[j]; break;
+      case Op::Pow:   for (std::size_t j = 0; j < len; j++) d[j] = std::pow(a[j], b[j]); break;
+      case Op::Atan2: for (std::size_t j = 0; j < len; j++) d[j] = std::atan2(a[j], b[j]); break;
+      case Op::Sin:   for (std::size_t j = 0; j < len; j++) d[j] = std::sin(a[j]); break;
+      case Op::Cos:   for (std::size_t j = 0; j < len; j++) d[j] = std::cos(a[j]); break;
+      case Op::Tan:   for (std::size_t j = 0; j < len; j++) d[j] = std::tan(a[j]); break;
+      case Op::Sqrt:  for (std::size_t j = 0; j < len; j++) d[j] = std::sqrt(a[j]); break;
+      case Op::Abs:   for (std::size_t j = 0; j < len; j++) d[j] = std::abs(a[j]); break;
+      case Op::Exp:   for (std::size_t j = 0; j < len; j++) d[j] = std::exp(a[j]); break;
+      case Op::Log:   for (std::size_t j = 0; j < len; j++) d[j] = std::log(a[j]); break;
+    }
+  }
+
+  // Emits op(a, b) into a free register, or folds it if its operands are constant
+  Operand emit(Op op, Operand a, Operand b = Operand{Kind::Const, 0})
+  {
+    bool unary = is_unary(op);
+    if (a.kind == Kind::Const && (unary || b.kind == Kind::Const))
+    {
+      T va = consts_[a.idx];
+      T vb = unary ? va : consts_[b.idx];
+      T folded = T();
+      run(op, &folded, &va, &vb, 1);
+      return constant(folded);
+    }
+    // The destination never aliases a source, so the loops don't fall back to scalar code
+    Instr in{op, new_reg(), a, unary ? a : b};
+    release(a);
+    if (!unary)
+      release(b);
+    code_.push_back(in);
+    return Operand{Kind::Reg, in.dst};
+  }
+
+  Operand parse_expr()
+  {
+    Operand x = parse_term();
+    for (;;)
+    {
+      if (accept("+"))
+        x = emit(Op::Add, x, parse_term());
+      else if (accept("-"))
+        x = emit(Op::Sub, x, parse_term());
+      else
+        return x;
+    }
+  }
+
+  Operand parse_term()
+  {
+    Operand x = parse_unary();
+    for (;;)
+    {
+      if (accept("*"))
+        x = emit(Op::Mul, x, parse_unary());
+      else if (accept("/"))
+        x = emit(Op::Div, x, parse_unary());
+      else
+        return x;
+    }
+  }
+
+  // Power binds tighter than unary minus, and is right associative: -a**b**c = -(a**(b**c))
+  Operand parse_unary()
+  {
+    if (accept("-"))
+      return emit(Op::Neg, parse_unary());
+    if (accept("+"))
+      return parse_unary();
+    Operand x = parse_primary();
+    if (accept("**") || accept("^"))
+      return emit(Op::Pow, x, parse_unary());
+    return x;
+  }
+
+  Operand parse_primary()
+  {
+    skip_spaces();
+    if (pos_ >= text_.size())
+      error("unexpected end of formula");
+
+    if (accept("("))
+    {
+      Operand x = parse_expr();
+      expect(")");
+      return x;
+    }
+
+    char c = text_[pos_];
+    if (std::isdigit(static_cast<unsigned char>(c)) || c == '.')
+    {
+      const char* begin = text_.c_str() + pos_;
+      char* end = nullptr;
+      double value = std::strtod(begin, &end);
+      if (end == begin)
+        error("invalid number");
+      pos_ += end - begin;
+      return constant(T(value));
+    }
+
+    if (!(std::isalpha(static_cast<unsigned char>(c)) || c == '_'))
+      error(std::string("unexpected character '") + c + "'");
+    std::size_t start = pos_;
+    while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '_'))
+      pos_++;
+    std::string name = text_.substr(start, pos_ - start);
+
+    if (accept("("))
+    {
+      static const std::map<std::string, Op> fns = {{"sin", Op::Sin}, {"cos", Op::Cos}, {"tan", Op::Tan}, {"sqrt", Op::Sqrt}, {"abs", Op::Abs},
+                                                    {"exp", Op::Exp}, {"log", Op::Log}, {"pow", Op::Pow}, {"atan2", Op::Atan2}};
+      auto fn = fns.find(name);
+      if (fn == fns.end())
+        error("unknown function " + name);
+      Operand x = parse_expr();
+      if (is_unary(fn->second))
+      {
+        expect(")");
+        return emit(fn->second, x);
+      }
+      expect(",");
+      Operand y = parse_expr();
+      expect(")");
+      return emit(fn->second, x, y);
+    }
+
+    if (name == "pi")
+      return constant(T(3.14159265358979323846));
+    auto it = std::find(vars_.begin(), vars_.end(), name);
+    if (it == vars_.end())
+      it = vars_.insert(vars_.end(), name);
+    return Operand{Kind::Var, std::size_t(it - vars_.begin())};
+  }
+
+public:
+  explicit ExprVectorFormula(const std::string& text) : text_(text)
+  {
+    Operand result = parse_expr();
+    skip_spaces();
+    if (pos_ != text_.size())
+      error("unexpected text");
+    if (result.kind == Kind::Reg)
+      code_.back().dst = nregs_++;    // the last instruction writes directly into the output
+    else
+      code_.push_back(Instr{Op::Copy, nregs_++, result, result});
+    free_regs_.clear();
+  }
+
+  // Compiled formulas are cached by their text (at most max_cached of them)
+  static std::shared_ptr<const ExprVectorFormula> compile(const std::string& text)
+  {
+    static std::mutex m;
+    static std::unordered_map<std::string, std::shared_ptr<const ExprVectorFormula>> cache;
+    std::lock_guard<std::mutex> lock(m);
+    if (cache.size() >= max_cached && cache.find(text) == cache.end())
+      cache.clear();
+    auto& f = cache[text];
+    if (!f)
+      f = std::make_shared<const ExprVectorFormula>(text);
+    return f;
+  }
+
+  const std::string& text() const {return text_;}
+
+  // Names of the variables, in order of appearance
+  const std::vector<std::string>& variables() const {return vars_;}
+
+  // Number of bytecode instructions
+  std::size_t instructions() const {return code_.size();}
+
+  // out[i] = formula(vars[...][i]) for i in [0,n). Every variable must have n elements
+  void eval(T* out, std::size_t n, const Inputs& vars) const
+  {
+    std::vector<const T*> inputs(vars_.size());
+    for (std::size_t k = 0; k < vars_.size(); k++)
+    {
+      auto it = vars.find(vars_[k]);
+      if (it == vars.end())
+        throw ExprVectorException(("ExprVectorFormula: variable " + vars_[k] + " was not given").c_str());
+      if (it->second.size != n)
+        throw ExprVectorException(("ExprVectorFormula: variable " + vars_[k] + " does not have the size of the output").c_str());
+      inputs[k] = it->second.data;
+    }
+
+    ExprVectorExecutor::instance().parallel_for(n, [&](std::size_t b, std::size_t e)
+    {
+      std::vector<T> regs((nregs_ - 1) * block_size);
+      std::vector<T> consts(consts_.size() * block_size);
+      for (std::size_t k = 0; k < consts_.size(); k++)
+        std::fill(consts.begin() + k*block_size, consts.begin() + (k+1)*block_size, consts_[k]);
+
+      for (std::size_t start = b; start < e; start += block_size)
+      {
+        std::size_t len = std::min(block_size, e - start);
+        auto ptr = [&](const Operand& x) -> const T*
+        {
+          switch (x.kind)
+          {
+            case Kind::Reg:   return x.idx == nregs_ - 1 ? out + start : regs.data() + x.idx * block_size;
+            case Kind::Var:   return inputs[x.idx] + start;
+            case Kind::Const: return consts.data() + x.idx * block_size;
+          }
+          return nullptr;
+        };
+        for (const Instr& in : code_)
+        {
+          T* d = in.dst == nregs_ - 1 ? out + start : regs.data() + in.dst * block_size;
+          run(in.op, d, ptr(in.a), ptr(in.b), len);
+        }
+      }
+    }, block_size);
+  }
+
+  template<typename Cont>
+  void eval(ExprVector<T, Cont>& out, const Inputs& vars) const {eval(out.data(), out.size(), vars);}
+};
+
+template<typename T>
+constexpr std::size_t ExprVectorFormula<T>::block_size;
+
+template<typename T>
+constexpr std::size_t ExprVectorFormula<T>::max_cached;
+
+namespace ev
+{
+  // Evaluates a formula given at run time into out, which must be already sized
+  // Example: ev::evaluate("a + 0.5*sin(b)", c, {{"a", a}, {"b", b}});
+  template<typename T, typename Cont>
+  void evaluate(const std::string& formula, ExprVector<T, Cont>& out, const typename ExprVectorFormula<T>::Inputs& vars)
+  {
+    ExprVectorFormula<T>::compile(formula)->eval(out, vars);
+  }
+}
+
+
+// Start of batched evaluation
+
+/** ExprVectorBatch evaluates the same element-wise formula over many short, independent vectors.
+    Consecutive short vectors are packed into long contiguous ones, so the formula runs over long
+    vectors (good for vectorization), and the packs are balanced between the workers by length */
+template<typename T, std::size_t NIn>
+class ExprVectorBatch
+{
+public:
+  struct Item
+  {
+    T* out;
+    std::array<const T*, NIn> in;
+    std::size_t n;
+  };
+
+private:
+  std::vector<Item> items_;
+
+  // Calls f(out, in[0], ..., in[NIn-1]) with views
+  template<typename F, std::size_t... I>
+  static void call(F& f, ExprVector<T, BuffDataExt<T>>& out, std::array<ExprVector<T, BuffDataExt<T>>, NIn>& in, std::index_sequence<I...>)
+  {
+    f(out, static_cast<const ExprVector<T, BuffDataExt<T>>&>(in[I])...);
+  }
+
+public:
+  void add(T* out, std::size_t n, const std::array<const T*, NIn>& in) {items_.push_back(Item{out, in, n});}
+
+  template<typename Cont, typename... Conts>
+  void add(ExprVector<T, Cont>& out, const ExprVector<T, Conts>&... in)
+  {
+    static_assert(sizeof...(Conts) == NIn, "wrong number of inputs");
+    add(out.data(), out.size(), {{in.data()...}});
+  }
+
+  void clear() {items_.clear();}
+
+  inline std::size_t size() const
+  {
+    return items_.size();
+  }
+
+  // Runs f(out, in0, in1, ...) over every item, where f assigns an element-wise expression of the
+  // inputs to out, as [](auto& out, auto& a, auto& b) {out = a*b + 2.0*a;}
+  template<typename F>
+  void run(F f, std::size_t pack_size = 16384) const
+  {
+    // Groups consecutive items into packs of about pack_size elements
+    std::vector<std::size_t> first(1, 0), offset(1, 0);
+    std::size_t len = 0;
+    for (std::size_t k = 0; k < items_.size(); k++)
+    {
+      len += items_[k].n;
+      if (len >= pack_size || k + 1 == items_.size())
+      {
+        first.push_back(k + 1);
+        offset.push_back(offset.back() + len);
+        len = 0;
+      }
+    }
+    std::size_t npacks = first.size() - 1;
+
+    ExprVectorExecutor::instance().parallel_for(offset.back(), [&](std::size_t b, std::size_t e)
+    {
+      ExprVector<T, BuffDataExt<T>> out;
+      std::array<ExprVector<T, BuffDataExt<T>>, NIn> in;
+      std::vector<T> scratch;
+
+      // Packs starting inside [b, e) belong to this chunk
+      for (std::size_t p = std::lower_bound(offset.begin(), offset.end() - 1, b) - offset.begin(); p < npacks && offset[p] < e; p++)
+      {
+        std::size_t n = offset[p+1] - offset[p];
+        if (first[p+1] - first[p] == 1)
+        {
+          // A single item is evaluated in place
+          const Item& it = items_[first[p]];
+          out.setBuffer(it.out, n);
+          for (std::size_t j = 0; j < NIn; j++)
+            in[j].setBuffer(it.in[j], n);
+          call(f, out, in, std::make_index_sequence<NIn>());
+          continue;
+        }
+
+        scratch.resize((NIn + 1) * n);
+        std::size_t pos = 0;
+        for (std::size_t k = first[p]; k < first[p+1]; k++)
+        {
+          for (std::size_t j = 0; j < NIn; j++)
+            std::copy(items_[k].in[j], items_[k].in[j] + items_[k].n, scratch.begin() + (j+1)*n + pos);
+          pos += items_[k].n;
+        }
+
+        out.setBuffer(scratch.data(), n);
+        for (std::size_t j = 0; j < NIn; j++)
+          in[j].setBuffer(scratch.data() + (j+1)*n, n);
+        call(f, out, in, std::make_index_sequence<NIn>());
+
+        pos = 0;
+        for (std::size_t k = first[p]; k < first[p+1]; k++)
+        {
+          std::copy(scratch.begin() + pos, scratch.begin() + pos + items_[k].n, items_[k].out);
+          pos += items_[k].n;
+        }
+      }
+    });
+  }
+};
+
+
+// Start of fused statements
+
+/** ExprVectorFusion records a sequence of element-wise assignments, as t = a*b; u = t + c; v = sqrt(u)*d;
+    and runs them in a single pass: every statement is evaluated over a block before moving to the next block,
+    so the data stays in cache. Intermediates created with temp() only exist in a block sized scratch buffer,
+    and statements whose results are never used are dropped. Vectors must have the same size and not overlap */
+template<typename T>
+class ExprVectorFusion
+{
+public:
+  using View = ExprVector<T, BuffDataExt<T>>;
+
+  // Handle of an intermediate vector, which is never materialized
+  struct Temp
+  {
+    std::size_t id;
+  };
+
+  static constexpr std::size_t block_size = 1024;
+
+private:
+  struct Statement
+  {
+    std::size_t write;
+    std::vector<std::size_t> reads;
+    std::function<void(std::vector<View>&)> run;
+  };
+
+  std::size_t n_;
+  std::vector<const T*> buffers_;   // full length buffer of each slot, nullptr for temporaries
+  std::vector<T*> writable_;        // the same buffer, for the slots which are assigned (nullptr if only read)
+  std::vector<bool> written_;
+  std::vector<Statement> statements_;
+
+  std::size_t slot(const Temp& t) const {return t.id;}
+
+  // Slot of a vector which is read
+  template<typename Cont>
+  std::size_t slot(const ExprVector<T, Cont>& x)
+  {
+    if (x.size() != n_)
+      throw ExprVectorException("ExprVectorFusion: all vectors must have the same size");
+    const T* p = x.data();
+    for (std::size_t k = 0; k < buffers_.size(); k++)
+      if (buffers_[k] == p && p != nullptr)
+        return k;
+    buffers_.push_back(p);
+    writable_.push_back(nullptr);
+    written_.push_back(true);
+    return buffers_.size() - 1;
+  }
+
+  // Slot of an assigned vector
+  template<typename Cont>
+  std::size_t dest_slot(ExprVector<T, Cont>& x)
+  {
+    std::size_t k = slot(static_cast<const ExprVector<T, Cont>&>(x));
+    writable_[k] = x.data();
+    return k;
+  }
+
+  std::size_t dest_slot(const Temp& t) const {return t.id;}
+
+  template<typename F, typename... Args>
+  void record(std::size_t w, F fn, const Args&... reads)
+  {
+    std::array<std::size_t, sizeof...(Args)> r{{slot(reads)...}};
+    for (std::size_t k : r)
+      if (!written_[k])
+        throw ExprVectorException("ExprVectorFusion: temporary read before being assigned");
+    written_[w] = true;
+    statements_.push_back(Statement{w, std::vector<std::size_t>(r.begin(), r.end()),
+                                    [fn, w, r](std::vector<View>& v) {call(fn, v, w, r, std::index_sequence_for<Args...>());}});
+  }
+
+  // A statement is live if it writes a vector, or a temporary read by a later live statement
+  std::vector<bool> liveness() const
+  {
+    std::vector<bool> needed(buffers_.size(), false), live(statements_.size(), false);
+    for (std::size_t k = statements_.size(); k-- > 0;)
+    {
+      const Statement& s = statements_[k];
+      bool temp = buffers_[s.write] == nullptr;
+      if (temp && !needed[s.write])
+        continue;
+      live[k] = true;
+      if (temp)
+        needed[s.write] = false;
+      for (std::size_t r : s.reads)
+        needed[r] = true;
+    }
+    return live;
+  }
+
+  template<typename F, std::size_t N, std::size_t... I>
+  static void call(const F& fn, std::vector<View>& v, std::size_t w, const std::array<std::size_t, N>& r, std::index_sequence<I...>)
+  {
+    fn(v[w], static_cast<const View&>(v[r[I]])...);
+  }
+
+public:
+  explicit ExprVectorFusion(std::size_t n) : n_(n) {}
+
+  inline std::size_t size() const
+  {
+    return n_;
+  }
+
+  Temp temp()
+  {
+    buffers_.push_back(nullptr);
+    writable_.push_back(nullptr);
+    written_.push_back(false);
+    return Temp{buffers_.size() - 1};
+  }
+
+  // Records the assignment done by fn(dest, reads...), which is called with views of one block
+  // Example: f.assign(t, [](auto& t, auto& a, auto& b) {t = a*b;}, a, b);
+  template<typename F, typename... Args>
+  void assign(const Temp& dest, F fn, const Args&... reads)
+  {
+    record(dest_slot(dest), fn, reads...);
+  }
+
+  template<typename Cont, typename F, typename... Args>
+  void assign(ExprVector<T, Cont>& dest, F fn, const Args&... reads)
+  {
+    std::size_t w = dest_slot(dest);   // before the reads, which may be dest too
+    record(w, fn, reads...);
+  }
+
+  // Number of recorded statements, and of those which are not dropped
+  std::size_t statements() const {return statements_.size();}
+
+  std::size_t live_statements() const
+  {
+    std::vector<bool> live = liveness();
+    return std::count(live.begin(), live.end(), true);
+  }
+
+  // Runs the live statements in one pass over the data. The recording is kept, so it can be run again
+  void run() const
+  {
+    std::vector<bool> live = liveness();
+    std::vector<std::size_t> scratch_pos(buffers_.size(), 0);
+    std::size_t ntemps = 0;
+    for (std::size_t k = 0; k < buffers_.size(); k++)
+      if (buffers_[k] == nullptr)
+        scratch_pos[k] = block_size * ntemps++;
+
+    ExprVectorExecutor::instance().parallel_for(n_, [&](std::size_t b, std::size_t e)
+    {
+      std::vector<View> views(buffers_.size());
+      std::vector<T> scratch(ntemps * block_size);
+      for (std::size_t start = b; start < e; start += block_size)
+      {
+        std::size_t len = std::min(block_size, e - start);
+        for (std::size_t k = 0; k < buffers_.size(); k++)
+        {
+          if (writable_[k])
+            views[k].setBuffer(writable_[k] + start, len);
+          else if (buffers_[k])
+            views[k].setBuffer(buffers_[k] + start, len);   // read only
+          else
+            views[k].setBuffer(scratch.data() + scratch_pos[k], len);
+        }
+        for (std::size_t k = 0; k < statements_.size(); k++)
+          if (live[k])
+            statements_[k].run(views);
+      }
+    }, block_size);
+  }
+
+  void clear()
+  {
+    buffers_.clear();
+    writable_.clear();
+    written_.clear();
+    statements_.clear();
+  }
+};
+
+template<typename T>
+constexpr std::size_t ExprVectorFusion<T>::block_size;
+
+
+// Start of ring buffers
+
+namespace ev
+{
+  // Plain view over the memory of the vector type V (V may be const)
+  template<typename V>
+  using view_t = ExprVector<typename std::remove_cv<typename std::remove_pointer<decltype(std::declval<V&>().data())>::type>::type,
+                            BuffDataExt<typename std::remove_cv<typename std::remove_pointer<decltype(std::declval<V&>().data())>::type>::type>>;
+
+  // The view of a vector V, as it is given to the function of ring_apply: const if V is const
+  template<typename V>
+  using view_arg_t = typename std::conditional<std::is_const<V>::value, const view_t<V>&, view_t<V>&>::type;
+
+  // The window and the views of const vectors are made with the read only setBuffer(const T*), and given as const
+  template<typename F, typename T, std::size_t... I, typename... Vs>
+  void ring_segments(F& fn, const ExprVector<T, BuffDataRing<T>>& ring, std::index_sequence<I...>, Vs&... others)
+  {
+    if (std::min({ring.size(), others.size()...}) < ring.size())
+      throw ExprVectorException("ev::ring_apply: vectors shorter than the window");
+    ExprVector<T, BuffDataExt<T>> w;
+    std::tuple<view_t<Vs>...> views;
+    std::size_t offset = 0;
+    for (int k = 0; k < 2; k++)
+    {
+      std::size_t len = ring.contents().segment_size(k);
+      if (len == 0)
+        continue;
+      w.setBuffer(ring.contents().segment_data(k), len);
+      (void)std::initializer_list<int>{(std::get<I>(views).setBuffer(others.data() + offset, len), 0)...};
+      fn(static_cast<const ExprVector<T, BuffDataExt<T>>&>(w), static_cast<view_arg_t<Vs>>(std::get<I>(views))...);
+      offset += len;
+    }
+  }
+
+  // Calls fn(window, others...) with plain views of each contiguous segment of a ring window (at most two),
+  // and of the same indices of the other vectors, so fn's expressions need no wrap around per element.
+  // The window is read only. Writes to the views of the other (non const) vectors go to their memory
+  // Example: ev::ring_apply([](auto& w, auto& out, auto& k) {out = w*k;}, win, out, kernel);
+  template<typename F, typename T, typename... Vs>
+  void ring_apply(F fn, const ExprVector<T, BuffDataRing<T>>& ring, Vs&... others)
+  {
+    ring_segments(fn, ring, std::index_sequence_for<Vs...>(), others...);
+  }
+
+  // Read only operands (temporaries included), given to fn as const views
+  template<typename F, typename T, typename V, typename... Vs>
+  void ring_apply(F fn, const ExprVector<T, BuffDataRing<T>>& ring, const V& first, const Vs&... others)
+  {
+    ring_segments(fn, ring, std::index_sequence_for<V, Vs...>(), first, others...);
+  }
+
+  // Reduces a ring window: fn reduces a segment (as ev::ring_apply), and op combines the results of the segments
+  // Example: double energy = ev::ring_reduce([](auto& w) {return (w*w).sum();}, std::plus<double>(), win);
+  template<typename F, typename Op, typename T, typename... Ts, typename... Conts>
+  auto ring_reduce(F fn, Op op, const ExprVector<T, BuffDataRing<T>>& ring, const ExprVector<Ts, Conts>&... others)
+  {
+    using R = decltype(fn(std::declval<const ExprVector<T, BuffDataExt<T>>&>(), std::declval<const ExprVector<Ts, BuffDataExt<Ts>>&>()...));
+    if (ring.size() == 0)
+      throw ExprVectorException("ev::ring_reduce: empty window");
+    R acc = R();
+    bool first = true;
+    auto visit = [&](auto&... views)
+    {
+      R r = fn(views...);
+      acc = first ? r : op(acc, r);
+      first = false;
+    };
+    ring_segments(visit, ring, std::index_sequence_for<Ts...>(), others...);
+    return acc;
+  }
+}
+
+
+// Start of incremental recomputation
+
+/** ExprVectorMaintained keeps out = f(inputs...) up to date for an element-wise f. update() re-evaluates only
+    the ranges written in the BuffDataTracked inputs since the previous update (other inputs are taken as
+    constant), and updates the sum of out with the change of those ranges. Each tracked input should feed a
+    single maintained result, and the vectors must outlive it and keep their size */
+template<typename T>
+class ExprVectorMaintained
+{
+  using Range = std::pair<std::size_t, std::size_t>;
+
+  std::size_t n_;
+  T* out_;
+  std::function<void(std::size_t, std::size_t)> eval_;    // evaluates [b, e) of out
+  std::function<std::vector<Range>()> take_;               // takes the written ranges of the inputs
+  std::function<void(std::size_t, std::size_t)> mark_;     // marks out as written, if it is tracked
+  T sum_ = T(0);
+
+  template<typename F, std::size_t... I, typename... Ts, typename... Conts>
+  static void eval_views(const F& fn, T* out, std::size_t b, std::size_t e, std::index_sequence<I...>, const ExprVector<Ts, Conts>&... inputs)
+  {
+    ExprVector<T, BuffDataExt<T>> o;
+    o.setBuffer(out + b, e - b);
+    std::tuple<ExprVector<Ts, BuffDataExt<Ts>>...> views;
+    (void)std::initializer_list<int>{(std::get<I>(views).setBuffer(inputs.data() + b, e - b), 0)...};
+    fn(o, static_cast<const ExprVector<Ts, BuffDataExt<Ts>>&>(std::get<I>(views))...);
+  }
+
+  template<typename T2>
+  static void take_ranges(std::vector<Range>& r, ExprVector<T2, BuffDataTracked<T2>>& x)
+  {
+    std::vector<Range> d = x.contents().take_dirty();
+    r.insert(r.end(), d.begin(), d.end());
+  }
+
+  template<typename T2, typename Cont>
+  static void take_ranges(std::vector<Range>&, ExprVector<T2, Cont>&) {}
+
+  static void mark_written(ExprVector<T, BuffDataTracked<T>>& x, std::size_t b, std::size_t e) {x.contents().mark(b, e);}
+
+  template<typename Cont>
+  static void mark_written(ExprVector<T, Cont>&, std::size_t, std::size_t) {}
+
+  // Memory of out (a tracked out is marked by mark_written() instead)
+  static T* out_data(ExprVector<T, BuffDataTracked<T>>& x) {return x.contents().untracked_data();}
+
+  template<typename Cont>
+  static T* out_data(ExprVector<T, Cont>& x) {return x.data();}
+
+  T range_sum(std::size_t b, std::size_t e) const
+  {
+    T s = T(0);
+    for (std::size_t i = b; i < e; i++)
+      s = s + out_[i];
+    return s;
+  }
+
+  void evaluate(std::size_t b, std::size_t e)
+  {
+    ExprVectorExecutor::instance().parallel_for(e - b, [&](std::size_t cb, std::size_t ce) {eval_(b + cb, b + ce);});
+    mark_(b, e);
+  }
+
+public:
+  // fn(out, inputs...) assigns an element-wise expression of views of the inputs to a view of out
+  // Example: ExprVectorMaintained<double> m(c, [](auto& c, auto& a, auto& b) {c = a*b + 1.0;}, a, b);
+  template<typename F, typename Cont, typename... Ts, typename... Conts>
+  ExprVectorMaintained(ExprVector<T, Cont>& out, F fn, ExprVector<Ts, Conts>&... inputs) : n_(out.size()), out_(out_data(out))
+  {
+    for (std::size_t s : {inputs.size()...})
+      if (s != n_)
+        throw ExprVectorException("ExprVectorMaintained: all vectors must have the same size");
+    T* o = out_;
+    eval_ = [fn, o, &inputs...](std::size_t b, std::size_t e)
+    {
+      eval_views(fn, o, b, e, std::index_sequence_for<Ts...>(), inputs...);
+    };
+    take_ = [&inputs...]()
+    {
+      std::vector<Range> r;
+      (void)std::initializer_list<int>{(take_ranges(r, inputs), 0)...};
+      ev::merge_ranges(r);
+      return r;
+    };
+    mark_ = [&out](std::size_t b, std::size_t e) {mark_written(out, b, e);};
+    refresh();
+  }
+
+  // Re-evaluates the ranges changed since the last update, and returns the number of elements evaluated
+  std::size_t update()
+  {
+    std::size_t count = 0;
+    for (const Range& r : take_())
+    {
+      std::size_t b = r.first, e = std::min(r.second, n_);
+      if (b >= e)
+        continue;
+      sum_ = sum_ - range_sum(b, e);
+      evaluate(b, e);
+      sum_ = sum_ + range_sum(b, e);
+      count += e - b;
+    }
+    return count;
+  }
+
+  // Evaluates everything again (also removes the rounding drift of the incremental sum)
+  void refresh()
+  {
+    take_();
+    evaluate(0, n_);
+    sum_ = range_sum(0, n_);
+  }
+
+  inline T sum() const {return sum_;}
+
+  inline std::size_t size() const
+  {
+    return n_;
+  }
+};
+
+
+// Start of sparse vectors
+
+/** ExprVectorSparseView reads a sparse vector densely (zeros included), so it can be used inside ExprVector expressions.
+    Sequential access is amortized O(1), as it continues from the position of the previous access to the same view */
+template<typename T>
+class ExprVectorSparseView
+{
+  const std::vector<std::size_t>& indices;
+  const std::vector<T>& values;
+  std::size_t n;
+  ev::search_hint hint;   // stored element where the last access ended
+
+public:
+  ExprVectorSparseView(const std::vector<std::size_t>& idx, const std::vector<T>& val, std::size_t n) : indices(idx), values(val), n(n) {}
+
+  inline T operator[](const std::size_t i) const
+  {
+    ev::search_hint::position& h = hint.local();
+    std::size_t p = std::min(h.get(), indices.size());
+    if (p > 0 && indices[p-1] >= i)
+      p = std::lower_bound(indices.begin(), indices.end(), i) - indices.begin();
+    else
+    {
+      std::size_t steps = 0;
+      while (p < indices.size() && indices[p] < i && ++steps < 8)
+        p++;
+      if (p < indices.size() && indices[p] < i)
+        p = std::lower_bound(indices.begin() + p, indices.end(), i) - indices.begin();
+    }
+    h.set(p);
+    return p < indices.size() && indices[p] == i ? values[p] : T(0);
+  }
+
+  inline std::size_t size() const
+  {
+    return n;
+  }
+};
+
+/** ExprVectorSparse is a vector of length n which stores only its non zero elements, as sorted indices and values.
+    Its operations only visit the stored elements, so they cost O(nnz) instead of O(n) */
+template<typename T>
+class ExprVectorSparse
+{
+public:
+  std::size_t n = 0;
+  std::vector<std::size_t> indices;   // sorted, without repetitions
+  std::vector<T> values;
+
+  ExprVectorSparse() {}
+  explicit ExprVectorSparse(std::size_t n) : n(n) {}
+  ExprVectorSparse(std::size_t n, std::vector<std::size_t> idx, std::vector<T> val) : n(n), indices(std::move(idx)), values(std::move(val))
+  {
+    if (indices.size() != values.size())
+      throw ExprVectorException("ExprVectorSparse: indices and values have different sizes");
+  }
+
+  inline std::size_t size() const
+  {
+    return n;
+  }
+
+  inline std::size_t nnz() const
+  {
+    return indices.size();
+  }
+
+  // Element i (binary search)
+  inline T operator[](const std::size_t i) const
+  {
+    auto it = std::lower_bound(indices.begin(), indices.end(), i);
+    return it != indices.end() && *it == i ? values[it - indices.begin()] : T(0);
+  }
+
+  // Dense view, for using the sparse vector inside ExprVector expressions
+  inline ExprVector<T, ExprVectorSparseView<T>> dense() const {return ExprVector<T, ExprVectorSparseView<T>>(ExprVectorSparseView<T>(indices, values, n));}
+
+  inline T sum() const
+  {
+    T val = T(0);
+    for (const T& v : values)
+      val = val + v;
+    return val;
+  }
 
-// This is not too much faster than vectors because of function calls..
-#define ADD_EXPR_VECT_FN_1_ARG(NAME, fn)                                   \
-                                                                           \
-template<typename T, typename Op1>                                         \
-class NAME                                                                 \
-{                                                                          \
-  const Op1& op1;                                                          \
-                                                                           \
-public:                                                                    \
-  using type = decltype(fn(op1[0]));                                       \
-  NAME(const Op1& a) : op1(a) {}                                           \
-                                                                           \
-  inline type operator[](const std::size_t i) const                        \
-  {                                                                        \
-    return fn(op1[i]);                                                     \
-  }                                                                        \
-                                                                           \
-  inline std::size_t size() const                                          \
-  {                                                                        \
-    return op1.size();                                                     \
-  }                                                                        \
-};                                                                         \
-                                                                           \
-                                                                           \
-template<typename T, typename R1>                                          \
-ExprVector<typename NAME<T, R1>::type, NAME<T, R1> >                       \
-inline fn (const ExprVector<T, R1>& a)                                     \
-{                                                                          \
-  return ExprVector<typename NAME<T, R1>::type, NAME<T, R1> >(NAME<T, R1>(a.contents()));      \
-}                                                                          \
+  // Keeps the non zero elements of a dense expression. Chunks are scanned in parallel, then copied in parallel
+  template<typename T2, typename R2>
+  static ExprVectorSparse from_dense(const ExprVector<T2, R2>& x)
+  {
+    struct Part {std::vector<std::size_t> idx; std::vector<T> val; std::size_t offset;};
+    std::map<std::size_t, Part> parts;   // by chunk start
+    std::mutex m;
+    auto& executor = ExprVectorExecutor::instance();
 
+    executor.parallel_for(x.size(), [&](std::size_t b, std::size_t e)
+    {
+      Part part;
+      for (std::size_t i = b; i < e; i++)
+      {
+        T v = x[i];
+        if (v != T(0))
+        {
+          part.idx.push_back(i);
+          part.val.push_back(v);
+        }
+      }
+      std::lock_guard<std::mutex> lock(m);
+      parts[b] = std::move(part);
+    });
+
+    ExprVectorSparse s(x.size());
+    std::size_t nnz = 0;
+    for (auto& p : parts)
+    {
+      p.second.offset = nnz;
+      nnz += p.second.idx.size();
+    }
+    s.indices.resize(nnz);
+    s.values.resize(nnz);
 
+    executor.parallel_for(x.size(), [&](std::size_t b, std::size_t)
+    {
+      const Part& part = parts.at(b);
+      std::copy(part.idx.begin(), part.idx.end(), s.indices.begin() + part.offset);
+      std::copy(part.val.begin(), part.val.end(), s.values.begin() + part.offset);
+    });
+    return s;
+  }
 
-// This is not too much faster than vectors because of function calls..
-#define ADD_EXPR_VECT_FN_2_ARG(NAME, fn)                                          \
-                                                                                  \
-template<typename T, typename Op1, typename Op2>                                  \
-class NAME                                                                        \
-{                                                                                 \
-  const Op1& op1;                                                                 \
-  const Op2& op2;                                                                 \
-                                                                                  \
-public:                                                                           \
-  NAME(const Op1& a, const Op1& b) : op1(a), op2(b) {}                            \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
-  {                                                                               \
-    return fn(op1[i], op2[i]);                                                    \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op1.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-                                                                                  \
-template<typename T, typename R1, typename R2>                                    \
-ExprVector<T, NAME<T, R1, R2> >                                                   \
-inline fn (const ExprVector<T, R1>& a, const ExprVector<T, R2>& b)                \
-{                                                                                 \
-  return ExprVector<T, NAME<T, R1, R2> >(NAME<T, R1, R2>(a.contents(), b.contents()));    \
-}                                                                                 \
+  // Writes the dense vector into out (resized if possible), each chunk zero filled and scattered in parallel
+  template<typename Cont>
+  void to_dense(ExprVector<T, Cont>& out) const
+  {
+    out.try_resize_if_needed(n);
+    if (out.size() != n)
+      throw ExprVectorException("ExprVectorSparse: the output of to_dense() has a different size");
+    ExprVectorExecutor::instance().parallel_for(n, [&](std::size_t b, std::size_t e)
+    {
+      auto&& target = ev::loop_target(out.contents(), b, e);
+      for (std::size_t i = b; i < e; i++)
+        target[i] = T(0);
+      for (std::size_t k = std::lower_bound(indices.begin(), indices.end(), b) - indices.begin(); k < indices.size() && indices[k] < e; k++)
+        target[indices[k]] = values[k];
+    });
+  }
 
+  ExprVector<T> to_dense() const {ExprVector<T> out; to_dense(out); return out;}
+};
 
-ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorAdd, +)
-ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorSubtr, -)
-ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorMult, *)
-ADD_EXPR_VECT_OPERATOR_2_ARGS(ExprVectorDiv, /)
+namespace ev
+{
+  // Merges the elements of a and b, as fn(a[i], b[i]) over the union (or the intersection) of their indices
+  template<typename T, typename F>
+  ExprVectorSparse<T> sparse_merge(const ExprVectorSparse<T>& a, const ExprVectorSparse<T>& b, F fn, bool intersection)
+  {
+    if (a.size() != b.size())
+      throw ExprVectorException("ExprVectorSparse: operands have different sizes");
+    ExprVectorSparse<T> r(a.size());
+    std::size_t i = 0, j = 0;
+    while (i < a.nnz() || j < b.nnz())
+    {
+      std::size_t ia = i < a.nnz() ? a.indices[i] : std::numeric_limits<std::size_t>::max();
+      std::size_t ib = j < b.nnz() ? b.indices[j] : std::numeric_limits<std::size_t>::max();
+      if (ia == ib)
+      {
+        r.indices.push_back(ia);
+        r.values.push_back(fn(a.values[i++], b.values[j++]));
+      }
+      else if (ia < ib)
+      {
+        if (!intersection)
+        {
+          r.indices.push_back(ia);
+          r.values.push_back(fn(a.values[i], T(0)));
+        }
+        i++;
+      }
+      else
+      {
+        if (!intersection)
+        {
+          r.indices.push_back(ib);
+          r.values.push_back(fn(T(0), b.values[j]));
+        }
+        j++;
+      }
+    }
+    return r;
+  }
 
-ADD_EXPR_VECT_PRE_OP(ExprVectPreSum, +)
-ADD_EXPR_VECT_PRE_OP(ExprVectPreSubtr, -)
-ADD_EXPR_VECT_PRE_OP(ExprVectPreMult, *)
-ADD_EXPR_VECT_PRE_OP(ExprVectPreDiv, /)
+  // Sum of a[i]*x[i], visiting only the non zero elements of a
+  template<typename T, typename T2, typename R2>
+  inline T dot(const ExprVectorSparse<T>& a, const ExprVector<T2, R2>& x)
+  {
+    T val = T(0);
+    for (std::size_t k = 0; k < a.nnz(); k++)
+      val = val + a.values[k] * x[a.indices[k]];
+    return val;
+  }
 
-ADD_EXPR_VECT_POST_OP(ExprVectPostSum, +)
-ADD_EXPR_VECT_POST_OP(ExprVectPostSubtr, -)
-ADD_EXPR_VECT_POST_OP(ExprVectPostMult, *)
-ADD_EXPR_VECT_POST_OP(ExprVectPostDiv, /)
+  template<typename T>
+  inline T dot(const ExprVectorSparse<T>& a, const ExprVectorSparse<T>& b) {return sparse_merge(a, b, [](T x, T y) {return x*y;}, true).sum();}
+}
 
-ADD_EXPR_VECT_PRE_SCALAR(ExprVectPreMultDouble, *, double)
-ADD_EXPR_VECT_POST_SCALAR(ExprVectPostMultDouble, *, double)
+template<typename T>
+inline ExprVectorSparse<T> operator+(const ExprVectorSparse<T>& a, const ExprVectorSparse<T>& b) {return ev::sparse_merge(a, b, [](T x, T y) {return x + y;}, false);}
 
-ADD_EXPR_VECT_PRE_SCALAR(ExprVectPreMultInt, *, int)
-ADD_EXPR_VECT_POST_SCALAR(ExprVectPostMultInt, *, int)
+template<typename T>
+inline ExprVectorSparse<T> operator-(const ExprVectorSparse<T>& a, const ExprVectorSparse<T>& b) {return ev::sparse_merge(a, b, [](T x, T y) {return x - y;}, false);}
 
-ADD_EXPR_VECT_POST_SCALAR(ExprVectPostDivDouble, /, double)
+template<typename T>
+inline ExprVectorSparse<T> operator*(const ExprVectorSparse<T>& a, const ExprVectorSparse<T>& b) {return ev::sparse_merge(a, b, [](T x, T y) {return x * y;}, true);}
 
-ADD_EXPR_VECT_FN_1_ARG(ExprVectorSin, sin)
-ADD_EXPR_VECT_FN_1_ARG(ExprVectorCos, cos)
-ADD_EXPR_VECT_FN_1_ARG(ExprVectorSqrt, sqrt)
-ADD_EXPR_VECT_FN_1_ARG(ExprVectorAbs, abs)
+// Sparse times dense: only the elements stored in the sparse vector are evaluated from the expression
+template<typename T, typename T2, typename R2>
+inline ExprVectorSparse<T> operator*(const ExprVectorSparse<T>& a, const ExprVector<T2, R2>& x)
+{
+  ExprVectorSparse<T> r(a.size(), a.indices, a.values);
+  for (std::size_t k = 0; k < r.nnz(); k++)
+    r.values[k] = r.values[k] * x[r.indices[k]];
+  return r;
+}
 
-ADD_EXPR_VECT_FN_2_ARG(ExprVectorAtan2, atan2)
+template<typename T, typename T2, typename R2>
+inline ExprVectorSparse<T> operator*(const ExprVector<T2, R2>& x, const ExprVectorSparse<T>& a) {return a * x;}
 
+template<typename T>
+inline ExprVectorSparse<T> operator*(T s, const ExprVectorSparse<T>& a)
+{
+  ExprVectorSparse<T> r(a.size(), a.indices, a.values);
+  for (T& v : r.values)
+    v = s * v;
+  return r;
+}
 
+template<typename T>
+inline ExprVectorSparse<T> operator*(const ExprVectorSparse<T>& a, T s) {return s * a;}
 
+template<typename T>
+inline ExprVectorSparse<T> operator/(const ExprVectorSparse<T>& a, T s) {return (T(1) / s) * a;}
 
-#define ADD_EXPR_VECT_PRE_OP_VECT(NAME, OP, TYPE)                                 \
-template<typename T, typename Op1, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>      \
-class NAME                                                                        \
-{                                                                                 \
-  const Op1& op1;                                                                 \
-  const Op2& op2;                                                                 \
-                                                                                  \
-public:                                                                           \
-  NAME(const Op1& a, const Op2& b) : op1(a), op2(b) {}                            \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
-  {                                                                               \
-    return op1[i] OP op2[i];                                                      \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op1.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-                                                                                  \
-template<typename T, typename R1, typename R2>                                    \
-inline ExprVector<T, NAME<T, R1, R2> >                                            \
-operator OP (const ExprVector<TYPE, R1>& a, const ExprVector<T, R2>& b)           \
-{                                                                                 \
-  return ExprVector<T, NAME<T, R1, R2> >(NAME<T, R1, R2 >(a.contents(), b.contents()));   \
-}                                                                                 \
+template<typename T>
+std::ostream& operator<<(std::ostream& os, const ExprVectorSparse<T>& s)
+{
+  os << "{";
+  for (std::size_t k = 0; k < s.nnz(); k++)
+    os << (k > 0 ? ", " : "") << s.indices[k] << ": " << s.values[k];
+  os << "} (size " << s.size() << ")";
+  return os;
+}
 
 
+// Start of .npy file support
 
+/** NpyHeader represents the header of a numpy .npy file **/
+struct NpyHeader
+{
+  std::string descr;             // dtype, as '<f8'
+  bool fortran_order = false;
+  std::vector<size_t> shape;
+  size_t data_offset = 0;        // bytes before the first element
 
-#define ADD_EXPR_VECT_POST_OP_VECT(NAME, OP, TYPE)                                \
-template<typename T, typename Op1, typename Op2, typename std::enable_if<!std::is_same<T,TYPE>::value, nullptr_t>::type = nullptr>       \
-class NAME                                                                        \
-{                                                                                 \
-  const Op1& op1;                                                                 \
-  const Op2& op2;                                                                 \
-                                                                                  \
-public:                                                                           \
-  NAME(const Op1& a, const Op2& b) : op1(a), op2(b) {}                            \
-                                                                                  \
-  inline T operator[](const std::size_t i) const                                  \
-  {                                                                               \
-    return op1[i] OP op2[i];                                                      \
-  }                                                                               \
-                                                                                  \
-  inline std::size_t size() const                                                 \
-  {                                                                               \
-    return op1.size();                                                            \
-  }                                                                               \
-};                                                                                \
-                                                                                  \
-                                                                                  \
-template<typename T, typename R1, typename R2>                                    \
-inline ExprVector<T, NAME<T, R1, R2> >                                            \
-operator OP (const ExprVector<T, R1>& a, const ExprVector<TYPE, R2>& b)           \
-{                                                                                 \
-  return ExprVector<T, NAME<T, R1, R2> >(NAME<T, R1, R2 >(a.contents(), b.contents()));   \
-}                                                                                 \
+  size_t count() const {size_t n = 1; for (size_t d : shape) n *= d; return n;}
+};
 
-ADD_EXPR_VECT_PRE_OP_VECT(ExprVectPreMultVectDouble, *, double)
-ADD_EXPR_VECT_POST_OP_VECT(ExprVectPostMultVectDouble, *, double)
-ADD_EXPR_VECT_POST_OP_VECT(ExprVectPostMultDivDouble, /, double)
+namespace ev
+{
+  inline bool is_little_endian() {const uint16_t x = 1; return *reinterpret_cast<const unsigned char*>(&x) == 1;}
+
+  // numpy dtype string of T in native byte order
+  template<typename T>
+  inline std::string npy_descr()
+  {
+    static_assert(std::is_arithmetic<T>::value, "npy files support arithmetic types only");
+    char kind = std::is_same<T, bool>::value ? 'b' : std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u';
+    char order = sizeof(T) == 1 ? '|' : is_little_endian() ? '<' : '>';
+    return std::string(1, order) + kind + std::to_string(sizeof(T));
+  }
+
+  // Checks that the file stores elements of type T, and returns whether their bytes must be swapped
+  template<typename T>
+  inline bool npy_check(const NpyHeader& h)
+  {
+    std::string native = npy_descr<T>();
+    if (h.descr.size() < 3 || h.descr.substr(1) != native.substr(1))
+      throw ExprVectorException(("npy file has dtype " + h.descr + ", expected " + native).c_str());
+    if (h.fortran_order && h.shape.size() > 1)
+      throw ExprVectorException("npy files in fortran order are not supported");
+    char order = h.descr[0];
+    return (order == '<' && !is_little_endian()) || (order == '>' && is_little_endian());
+  }
+
+  template<typename T>
+  inline void byte_swap(T* p, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      unsigned char* b = reinterpret_cast<unsigned char*>(p + i);
+      std::reverse(b, b + sizeof(T));
+    }
+  }
+
+  inline NpyHeader npy_read_header(std::istream& is)
+  {
+    char magic[8];
+    if (!is.read(magic, 8) || std::string(magic, 6) != "\x93NUMPY")
+      throw ExprVectorException("not a npy file");
+
+    unsigned char len_bytes[4] = {0, 0, 0, 0};
+    size_t len_size = magic[6] == 1 ? 2 : 4;
+    if (!is.read(reinterpret_cast<char*>(len_bytes), len_size))
+      throw ExprVectorException("truncated npy header");
+    size_t len = len_bytes[0] | (len_bytes[1] << 8) | (size_t(len_bytes[2]) << 16) | (size_t(len_bytes[3]) << 24);
+
+    std::string dict(len, ' ');
+    if (!is.read(&dict[0], len))
+      throw ExprVectorException("truncated npy header");
+
+    NpyHeader h;
+    h.data_offset = 8 + len_size + len;
+
+    auto value_of = [&](const std::string& key) -> size_t
+    {
+      size_t pos = dict.find("'" + key + "'");
+      if (pos == std::string::npos)
+        throw ExprVectorException(("npy header without " + key).c_str());
+      return dict.find(':', pos) + 1;
+    };
+
+    size_t pos = dict.find('\'', value_of("descr"));
+    h.descr = dict.substr(pos + 1, dict.find('\'', pos + 1) - pos - 1);
+
+    pos = value_of("fortran_order");
+    h.fortran_order = dict.compare(dict.find_first_not_of(' ', pos), 4, "True") == 0;
+
+    pos = dict.find('(', value_of("shape"));
+    size_t end = dict.find(')', pos);
+    std::stringstream ss(dict.substr(pos + 1, end - pos - 1));
+    std::string dim;
+    while (std::getline(ss, dim, ','))
+      if (dim.find_first_of("0123456789") != std::string::npos)
+        h.shape.push_back(std::stoul(dim));
+    return h;
+  }
+
+  inline void npy_write_header(std::ostream& os, const std::string& descr, size_t n)
+  {
+    std::string dict = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (" + std::to_string(n) + ",), }";
+    size_t total = 10 + dict.size() + 1;
+    dict.append((64 - total % 64) % 64, ' ');
+    dict.push_back('\n');
+
+    const char magic[] = "\x93NUMPY\x01\x00";
+    os.write(magic, 8);
+    unsigned char len_bytes[2] = {static_cast<unsigned char>(dict.size() & 0xff), static_cast<unsigned char>(dict.size() >> 8)};
+    os.write(reinterpret_cast<const char*>(len_bytes), 2);
+    os.write(dict.data(), dict.size());
+  }
+
+  // Saves any expression as a .npy file. It is evaluated in chunks, so the result is never fully stored
+  template<typename T, typename Cont>
+  void save_npy(const std::string& path, const ExprVector<T, Cont>& x)
+  {
+    std::ofstream f(path, std::ios::binary);
+    if (!f)
+      throw ExprVectorException(("Cannot open " + path + " for writing").c_str());
+    npy_write_header(f, npy_descr<T>(), x.size());
+
+    const size_t chunk = 8192;
+    std::vector<T> buf(std::min(chunk, x.size()));
+    for (size_t b = 0; b < x.size(); b += chunk)
+    {
+      size_t e = std::min(b + chunk, x.size());
+      for (size_t i = b; i < e; i++)
+        buf[i-b] = x[i];
+      f.write(reinterpret_cast<const char*>(buf.data()), (e-b)*sizeof(T));
+    }
+    if (!f)
+      throw ExprVectorException(("Error writing " + path).c_str());
+  }
+
+  // Loads a .npy file into x, which is resized if possible
+  template<typename T, typename Cont>
+  void load_npy(const std::string& path, ExprVector<T, Cont>& x)
+  {
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+      throw ExprVectorException(("Cannot open " + path).c_str());
+    NpyHeader h = npy_read_header(f);
+    bool swap = npy_check<T>(h);
+    size_t n = h.count();
+    x.try_resize_if_needed(n);
+    if (x.size() != n)
+      throw ExprVectorException("npy file size does not match the ExprVector size");
+
+    const size_t chunk = 8192;
+    std::vector<T> buf(std::min(chunk, n));
+    for (size_t b = 0; b < n; b += chunk)
+    {
+      size_t e = std::min(b + chunk, n);
+      if (!f.read(reinterpret_cast<char*>(buf.data()), (e-b)*sizeof(T)))
+        throw ExprVectorException(("truncated npy file " + path).c_str());
+      if (swap)
+        byte_swap(buf.data(), e-b);
+      for (size_t i = b; i < e; i++)
+        x[i] = buf[i-b];
+    }
+  }
+
+  template<typename T>
+  ExprVector<T> load_npy(const std::string& path) {ExprVector<T> x; load_npy(path, x); return ExprVector<T>(std::move(x.cont));}
+}
+
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/** BuffDataMmap is a view over the elements of a memory mapped .npy file. Written elements are not saved to the file **/
+template<typename T>
+class BuffDataMmap
+{
+  T* buffer_ = nullptr;
+  size_t n_ = 0;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+
+public:
+  BuffDataMmap() {}
+  BuffDataMmap(const BuffDataMmap& other) = delete;
+  ~BuffDataMmap() {close();}
+
+  void open(const std::string& path)
+  {
+    close();
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+      throw ExprVectorException(("Cannot open " + path).c_str());
+    NpyHeader h = ev::npy_read_header(f);
+    if (ev::npy_check<T>(h))
+      throw ExprVectorException("npy file byte order differs from the native one, use ev::load_npy()");
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < h.data_offset + h.count()*sizeof(T))
+    {
+      if (fd >= 0)
+        ::close(fd);
+      throw ExprVectorException(("Cannot map " + path).c_str());
+    }
+    map_size_ = st.st_size;
+    map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED)
+    {
+      map_ = nullptr;
+      throw ExprVectorException(("Cannot map " + path).c_str());
+    }
+    buffer_ = reinterpret_cast<T*>(static_cast<char*>(map_) + h.data_offset);
+    n_ = h.count();
+  }
+
+  void close()
+  {
+    if (map_ != nullptr)
+      munmap(map_, map_size_);
+    map_ = nullptr;
+    buffer_ = nullptr;
+    n_ = 0;
+  }
+
+  inline T operator[](const std::size_t i) const
+  {
+    return buffer_[i];
+  }
+
+  inline T& operator[](const std::size_t i)
+  {
+    return buffer_[i];
+  }
+
+  inline T* data() {return buffer_;}
+  inline const T* data() const {return buffer_;}
+
+  inline std::size_t size() const
+  {
+    return n_;
+  }
+};
+
+namespace ev
+{
+  // Maps a .npy file without copying it
+  template<typename T>
+  void map_npy(const std::string& path, ExprVector<T, BuffDataMmap<T>>& x) {x.contents().open(path);}
+}
+
+#endif
 
 #endif // EXPR_VECTOR_H_PL_
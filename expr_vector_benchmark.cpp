@@ -77,15 +77,20 @@ int main()
   size_t n2 = 3;
   std::vector<double> a0(n), b0(n), c0(n);
 
-  for (size_t i = 0; i < n; i++)
-    a0[i] = rand();    // = M_PI/2
-  for (size_t i = 0; i < n; i++)
-    b0[i] = 2*rand();  // = 0
+  {
+    // Inputs are filled from lazy counter-based random generators (reproducible and parallel-safe)
+    ExprVector<double, BuffDataExt<double>> a, b;
+    a.setBuffer(a0.data(), a0.size());
+    b.setBuffer(b0.data(), b0.size());
+    a = ev::random_uniform<double>(n, 1, 0, RAND_MAX);    // = M_PI/2
+    b = ev::random_uniform<double>(n, 2, 0, 2.0*RAND_MAX);  // = 0
+  }
   
   double t_valarray;
   double t_exprvector;
   double t_rawfor;
   double t_vector;
+  double t_formula;
 
 
 //#define FORMULA     c = a + (b*a+b)*a + (a*b) + (a*b*b*a) + (a*a*a) + b;
@@ -94,6 +99,12 @@ int main()
 //#define FORMULA     c = sin( (a+b) ) + sin(a);
 //#define FORMULA     c = atan2(a, b);
 
+//#define FORMULA_STR     "a + (b*a+b)*a + (a*b) + (a*b*b*a) + (a*a*a) + b"
+#define FORMULA_STR     "a + 0.5*a + 0.5*a"
+//#define FORMULA_STR     "a"
+//#define FORMULA_STR     "sin( (a+b) ) + sin(a)"
+//#define FORMULA_STR     "atan2(a, b)"
+
 //#define FORMULA_FOR     c[i] = a[i] + (b[i]*a[i]+b[i])*a[i] + (a[i]*b[i]) + (a[i]*b[i]*b[i]*a[i]) + (a[i]*a[i]*a[i]) + b[i];
 #define FORMULA_FOR     c[i] = a[i] + 0.5*a[i] + 0.5*a[i];
 //#define FORMULA_FOR     c[i] = a[i];
@@ -104,6 +115,7 @@ int main()
   {
     std::vector<double> a(n,0), b(n,1), c(n,2);
     c = a+b+a+b+a+b;
+    ExprVectorFormula<double>::compile(FORMULA_STR);   // compiled formulas are cached
   }  
 
   // valarray
@@ -144,6 +156,21 @@ int main()
     t_exprvector = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
   }
 
+  // ExprVectorFormula (formula given as text at run time)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t u=0; u<n2; u++)
+    {
+      ExprVector<double, BuffDataExt<double>> c;
+      c.setBuffer(c0.data(), c0.size());
+
+      ev::evaluate(FORMULA_STR, c, {{"a", {a0.data(), a0.size()}}, {"b", {b0.data(), b0.size()}}});
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    t_formula = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+  }
+
   // raw for
   {
     std::vector<double> a=a0, b=b0;
@@ -177,11 +204,41 @@ int main()
     t_vector = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
   }
 
+  std::cout << "Evaluation loops for: " << ev::isa_name(ev::isa()) << " (set EXPR_VECTOR_ISA to override)" << std::endl;
   std::cout << "Processing time respect to raw for, Time[ns]: " << t_rawfor << std::endl;
   std::cout << "raw for:      " << t_rawfor / t_rawfor <<std::endl;
   std::cout << "ExprVector:   " << t_exprvector / t_rawfor <<std::endl;
+  std::cout << "Formula:      " << t_formula / t_rawfor <<std::endl;
   std::cout << "valarray:     " << t_valarray / t_rawfor <<std::endl;
   std::cout << "vector(move): " << t_vector / t_rawfor <<std::endl;
 
+  // Streaming stores, used when the destination doesn't fit in the last level cache
+  {
+    // Twice the threshold, at most 64 MiB per vector. A lower threshold is set when the cap is below it, so the
+    // automatic path is taken (the vectors then fit in the cache, which favors regular stores)
+    size_t threshold = ev::stream_threshold();
+    size_t nb = std::min<size_t>(std::max<size_t>(threshold / sizeof(double), n) * 2, size_t(8) << 20);
+    ev::set_stream_threshold(std::min(threshold, nb / 2 * sizeof(double)));
+    ExprVector<double> a(nb, 1.0), c(nb, 0.0);
+    std::cout << "Streaming stores for " << n * sizeof(double) << " bytes: " << (ExprVector<double>(n).uses_streaming_stores() ? "yes" : "no")
+              << ", for " << nb * sizeof(double) << " bytes: " << (c.uses_streaming_stores() ? "yes" : "no")
+              << " (threshold: " << ev::stream_threshold() << " bytes, cache: " << threshold << " bytes)" << std::endl;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t u=0; u<n2; u++)
+      c.assign_range(a + 0.5*a + 0.5*a, 0, nb);
+    auto stop = std::chrono::high_resolution_clock::now();
+    double t_regular = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t u=0; u<n2; u++)
+      c = a + 0.5*a + 0.5*a;
+    stop = std::chrono::high_resolution_clock::now();
+    double t_streaming = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+
+    std::cout << "streaming stores respect to regular: " << t_streaming / t_regular << std::endl;
+    ev::set_stream_threshold(threshold);
+  }
+
   return 0;
 }
@@ -3,6 +3,9 @@
 
 #include "expr_vector.h"
 #include <iostream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#endif
 
 int main()
 {
@@ -26,6 +29,10 @@ int main()
 
   std::cout << "Sum (external buffer):    " << c.sum() << std::endl;
 
+  // Evaluation loops are compiled for several instruction sets, and chosen for the CPU at run time
+  // (EXPR_VECTOR_ISA=avx2, for example, lowers the choice)
+  std::cout << "Evaluation loops for:     " << ev::isa_name(ev::isa()) << std::endl;
+
   // Not providing external buffer
   ExprVector<double> d(n), e(n), f;
 
@@ -62,5 +69,232 @@ int main()
 
   std::cout << s2 << std::endl;
 
+  // Fixed size vectors (no heap allocation, unrolled evaluation)
+
+  ExprVectorFixed<double, 3> p3 = {1, 2, 3}, q3(3, 0.5), r3;
+  r3 = p3*q3 + p3;
+
+  std::cout << "Fixed size: " << r3 << std::endl;
+
+  // Lazy generators (computed from the index, they use no memory)
+
+  ExprVector<double> sig;
+  sig = sin(ev::arange(0.0, 40.0, 0.1)) + 0.5*ev::random_normal<double>(400, 42);
+
+  std::cout << "Generated signal sum: " << sig.sum() << std::endl;
+
+  // User defined element-wise functions, fused with the rest of the expression
+
+  ExprVector<double> clipped;
+  clipped = 2.0 * ev::map([](double x, double lim) {return x < lim ? x : lim;}, sig, ev::constant(0.5, sig.size()));
+
+  std::cout << "Clipped sum: " << clipped.sum() << std::endl;
+
+  // Multiply-add patterns are evaluated with fma when EXPR_VECTOR_FMA is 1 (the default for targets with FMA, as -march=native)
+
+  ExprVector<double> poly;
+  poly = ((0.25*sig - 0.5)*sig + 1.0)*sig + 2.0;
+
+  std::cout << "Polynomial sum: " << poly.sum() << " (fma: " << EXPR_VECTOR_FMA << ")" << std::endl;
+
+  // Formulas given as text at run time
+
+  ExprVector<double> fsig(sig.size()), fx(ev::arange(0.0, 40.0, 0.1));
+  ev::evaluate("2*sig - sin(x)", fsig, {{"sig", sig}, {"x", fx}});
+
+  std::cout << "Formula sum: " << fsig.sum() << std::endl;
+
+  // One formula over many short vectors (packed into long ones)
+
+  std::vector<ExprVector<double>> win_in(100, ExprVector<double>(50, 2.0)), win_out(100, ExprVector<double>(50));
+  ExprVectorBatch<double, 1> batch;
+  for (size_t k = 0; k < win_in.size(); k++)
+    batch.add(win_out[k], win_in[k]);
+  batch.run([](auto& out, auto& x) {out = x*x + 1.0;});
+
+  std::cout << "Batch window sum: " << win_out[99].sum() << std::endl;
+
+  // Several statements fused in a single pass (t and u are never materialized, and dead is dropped)
+
+  ExprVector<double> fused_out(sig.size());
+  ExprVectorFusion<double> fusion(sig.size());
+  auto t = fusion.temp(), tu = fusion.temp(), dead = fusion.temp();
+  fusion.assign(t, [](auto& t, auto& a, auto& b) {t = a*b;}, sig, fsig);
+  fusion.assign(tu, [](auto& u, auto& t) {u = t*t + 1.0;}, t);
+  fusion.assign(dead, [](auto& d, auto& u) {d = 2.0*u;}, tu);
+  fusion.assign(fused_out, [](auto& v, auto& u, auto& a) {v = sqrt(u)*a;}, tu, sig);
+  fusion.run();
+
+  std::cout << "Fused sum: " << fused_out.sum() << " (" << fusion.live_statements() << " of " << fusion.statements() << " statements)" << std::endl;
+
+  // Ring buffers keep the last samples, and their window is evaluated as (at most) two plain segments
+
+  ExprVector<double, BuffDataRing<double>> win(8);
+  for (int i = 0; i < 10; i++)
+    win.contents().push(i);
+  win.contents().append(2.0*ev::arange(10.0, 13.0, 1.0));
+
+  ExprVector<double> kernel(8, 0.5), smooth(8);
+  ev::ring_apply([](auto& w, auto& out, auto& k) {out = w*k;}, win, smooth, kernel);
+  double energy = ev::ring_reduce([](auto& w) {return (w*w).sum();}, std::plus<double>(), win);
+
+  std::cout << "Ring window: " << win << ", smoothed sum: " << smooth.sum() << ", energy: " << energy << std::endl;
+
+  // Maintained results: after small writes to tracked inputs, only the written ranges are evaluated again
+
+  ExprVector<double, BuffDataTracked<double>> ta(n, 1.0), tb(n, 2.0);
+  ExprVector<double> tc(n);
+  ExprVectorMaintained<double> mc(tc, [](auto& c, auto& a, auto& b) {c = a*b + 1.0;}, ta, tb);
+  for (size_t i = 100; i < 200; i++)
+    ta[i] = 3.0;
+  tb[{5000, 5010, 1}] = ev::constant(4.0, 10);
+  size_t evaluated = mc.update();
+
+  std::cout << "Maintained sum: " << mc.sum() << " (full: " << tc.sum() << "), evaluated " << evaluated << " elements" << std::endl;
+
+  // Interpolation, resampling and table lookups are lazy, and fuse with the rest of the expression
+  // (the grid of ev::arange() is known to be uniform, so its segments are computed instead of searched)
+
+  ExprVector<double> fine, coarse, squeezed, knots(4), looked;
+  fine = 2.0 * ev::interp(ev::linspace(0.0, 39.9, 1000), ev::arange(0.0, 40.0, 0.1), sig);
+  knots = {0.0, 1.0, 3.0, 4.0};
+  coarse = ev::interp(ev::downsample(fine, 10), knots, ev::upsample(ev::resample(knots, 2), 3));
+  squeezed = ev::resample(sig, 160) + 1.0;
+  ExprVector<int> levels = {-1, 0, 2, 7};
+  looked = ev::lookup(levels, ExprVector<double>({0.5, 1.5, 2.5}));
+
+  std::cout << "Interpolated sum: " << fine.sum() << ", " << coarse.sum() << ", resampled: " << squeezed.sum() << ", lookup: " << looked << std::endl;
+
+  // Sparse vectors (operations only visit the non zero elements)
+
+  ExprVectorSparse<double> sp1 = ExprVectorSparse<double>::from_dense(ev::map([](double x) {return x > 1.0 ? x : 0.0;}, sig));
+  ExprVectorSparse<double> sp2 = 2.0 * sp1 + sp1 * sig;
+
+  std::cout << "Sparse nnz: " << sp2.nnz() << ", sum: " << sp2.sum() << ", dot: " << ev::dot(sp1, sig) << std::endl;
+
+  // Histograms of expressions (per thread private bins)
+
+  std::vector<size_t> hist = ev::histogram(2.0*sig, 4, -2.0, 2.0);
+
+  std::cout << "Histogram:";
+  for (size_t c : hist)
+    std::cout << " " << c;
+  std::cout << std::endl;
+
+  // Saturating 8 bit arithmetic for image data (the element type is kept, no promotion to int)
+
+  std::vector<uint8_t> img0(64, 200), img1(64, 100);
+  ExprVector<uint8_t, BuffDataExt<uint8_t>> img, img2;
+  img.setBuffer(img0.data(), img0.size());
+  img2.setBuffer(img1.data(), img1.size());
+  ExprVector<uint8_t> sat_add(64), sat_sub(64), blend(64);
+  sat_add = ev::adds(img, img2);
+  sat_sub = ev::subs(img2, img);
+  blend = ev::avg(ev::adds(img, img2), ev::mul_scaled(img2, 64, 8));
+
+  std::cout << "Saturated: " << int(sat_add[0]) << ", " << int(sat_sub[0]) << ", blend: " << int(blend[0]) << std::endl;
+
+  // Searches stop as soon as the answer is known
+
+  size_t first_high = ev::find_first(2.0*sig, [](double v) {return v > 2.5;});
+  bool has_nan = ev::any(sig, [](double v) {return std::isnan(v);});
+
+  std::cout << "First above 2.5: " << first_high << ", any NaN: " << has_nan << ", argmin: " << ev::argmin(sig) << ", argmax: " << ev::argmax(sig) << std::endl;
+
+  // Aggregates per key: reduce_by_key() over sorted runs of keys, group_by() for keys in any order
+
+  ExprVector<int> sensor(n), bucket(n);
+  for (size_t i = 0; i < n; i++)
+  {
+    sensor[i] = int(i * 7 % 5);
+    bucket[i] = int(i / 2500);
+  }
+  auto by_bucket = ev::reduce_by_key(bucket, ev::arange(0.0, double(n), 1.0));
+  auto by_sensor = ev::group_by(sensor, 2.0*ev::arange(0.0, double(n), 1.0));
+
+  std::cout << "Buckets: " << by_bucket.keys << ", max: " << by_bucket.max << ", sensors: " << by_sensor.keys << ", count: " << by_sensor.count << ", mean: " << by_sensor.mean() << std::endl;
+
+  // Above the parallel threshold each worker reduces a chunk, and the runs split between chunks (1500 does not divide them) are merged
+  size_t n_samples = 100000;
+  ExprVector<int> day(n_samples);
+  for (size_t i = 0; i < n_samples; i++)
+    day[i] = int(i / 1500);
+  auto by_day = ev::reduce_by_key(day, ev::arange(0.0, double(n_samples), 1.0));
+  std::cout << "Days: " << by_day.size() << ", count: " << by_day.count[ev::argmin(by_day.count)] << " to " << by_day.count[ev::argmax(by_day.count)]
+            << ", mean of the last: " << by_day.mean()[by_day.size() - 1] << std::endl;
+
+  // Asynchronous evaluation (tasks sharing buffers are run in submission order)
+
+  ExprVector<double> g(n, 1), h(n, 2), k(n), l(n);
+
+  auto fk = ev::async_assign(k, [&]{ k = g + h; }, g, h);
+  auto fl = ev::async_assign(l, [&]{ l = 2.0*k; }, k);
+  auto fs = ev::async_eval([&]{ return l.sum(); }, l);
+
+  std::cout << "Async sum: " << fs.get() << std::endl;
+
+  // Constructing from an expression allocates once and doesn't zero fill (ev::uvector neither zero fills on resize)
+
+  ExprVector<double> u(g[{_,5,_}] + h[{_,5,_}]);
+  ExprVector<double, ev::uvector<double>> w(n);
+  w = g + h;
+
+  std::cout << "Constructed from expression: " << u << ", sum: " << w.sum() << std::endl;
+
+  // Streaming stores bypass the cache: used automatically when the destination is bigger than ev::stream_threshold(), or explicitly
+
+  ExprVector<double> streamed(n);
+  streamed.stream() = g + 0.5*h;
+
+  std::cout << "Streamed sum: " << streamed.sum() << " (automatic: " << streamed.uses_streaming_stores() << ", threshold: " << ev::stream_threshold() << " bytes)" << std::endl;
+
+  // NUMA placed buffers, first touched and evaluated in parallel by the same (pinned) workers
+
+  ExprVectorExecutor::instance().pin_threads();
+
+  ExprVector<double, BuffDataNuma<double>> p(1000000, 1.0), q;
+  q.assign_parallel(p + 0.5*p);
+
+  std::cout << "NUMA sum: " << q.sum() << std::endl;
+
+  // .npy files (the expression is evaluated while saving, and the file can be mapped without copying)
+
+  ev::save_npy("test_expr_vector.npy", g + 0.5*h);
+  ExprVector<double> r = ev::load_npy<double>("test_expr_vector.npy");
+  std::cout << "npy sum (loaded): " << r.sum() << std::endl;
+#if defined(__unix__) || defined(__APPLE__)
+  {
+    ExprVector<double, BuffDataMmap<double>> m;
+    ev::map_npy("test_expr_vector.npy", m);
+    std::cout << "npy sum (mapped): " << m.sum() << std::endl;
+  }
+#endif
+  std::remove("test_expr_vector.npy");
+
+  // Shared memory between processes (a forked reader waits for the writer, and reads the same pages). The forked
+  // child must not run anything on ExprVectorExecutor (parallel_for, assign_parallel, async): the pool threads of
+  // the parent don't exist after fork(), so it would wait forever. The reader attaches read only, and writing
+  // through it throws
+#if defined(__unix__) || defined(__APPLE__)
+  {
+    ExprVector<double, BuffDataShm<double>> shared;
+    shared.contents().create("expr_vector_test", n);
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      ExprVector<double, BuffDataShm<double>> view;
+      view.contents().attach("expr_vector_test");
+      view.contents().wait_ready();
+      std::cout << "Shared memory sum (reader process): " << view.sum() << std::endl;
+      _exit(0);
+    }
+    shared.contents().begin_write();
+    shared = g + 0.5*h;
+    shared.contents().end_write();
+    waitpid(pid, nullptr, 0);
+  }
+#endif
+
   return 0;
 }